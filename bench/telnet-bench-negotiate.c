@@ -0,0 +1,244 @@
+/*
+ * Sean Middleditch
+ * sean@sourcemud.org
+ *
+ * The author or authors of this code dedicate any and all copyright interest
+ * in this code to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and successors. We
+ * intend this dedication to be an overt act of relinquishment in perpetuity of
+ * all present and future rights to this code under copyright law.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libtelnet.h"
+
+/* connections simulated by the state table comparison */
+#define CONNECTIONS 20000
+
+/* times each connection renegotiates its options */
+#define ROUNDS 8
+
+/* negotiation storms fed through telnet_recv() */
+#define STORMS 2000
+
+/* RFC1143 state entry as kept by the legacy scheme */
+typedef struct legacy_entry {
+	unsigned char telopt;
+	unsigned char state;
+} legacy_entry_t;
+
+/* the legacy scheme: an unsorted array searched linearly and grown by
+ * realloc() four entries at a time */
+typedef struct legacy_table {
+	legacy_entry_t *q;
+	unsigned int q_size;
+	unsigned int q_cnt;
+} legacy_table_t;
+
+static unsigned char legacy_get(legacy_table_t *t, unsigned char telopt) {
+	unsigned int i;
+
+	for (i = 0; i != t->q_cnt; ++i) {
+		if (t->q[i].telopt == telopt)
+			return t->q[i].state;
+	}
+	return 0;
+}
+
+static void legacy_set(legacy_table_t *t, unsigned char telopt,
+		unsigned char state) {
+	legacy_entry_t *qtmp;
+	unsigned int i;
+
+	for (i = 0; i != t->q_cnt; ++i) {
+		if (t->q[i].telopt == telopt) {
+			t->q[i].state = state;
+			return;
+		}
+	}
+
+	if (t->q_cnt >= t->q_size) {
+		if ((qtmp = (legacy_entry_t *)realloc(t->q,
+				sizeof(legacy_entry_t) * (t->q_size + 4))) == 0) {
+			fprintf(stderr, "realloc() failed\n");
+			exit(1);
+		}
+		memset(&qtmp[t->q_size], 0, sizeof(legacy_entry_t) * 4);
+		t->q = qtmp;
+		t->q_size += 4;
+	}
+	t->q[t->q_cnt].telopt = telopt;
+	t->q[t->q_cnt].state = state;
+	++t->q_cnt;
+}
+
+/* the current scheme: one state byte per telopt */
+typedef struct direct_table {
+	unsigned char q[256];
+} direct_table_t;
+
+static unsigned char direct_get(direct_table_t *t, unsigned char telopt) {
+	return t->q[telopt];
+}
+
+static void direct_set(direct_table_t *t, unsigned char telopt,
+		unsigned char state) {
+	t->q[telopt] = state;
+}
+
+/* fill order with a shuffled set of telopts, as a probing client sends
+ * them */
+static void make_order(unsigned char *order) {
+	unsigned long seed = 12345;
+	unsigned int i, j;
+	unsigned char tmp;
+
+	for (i = 0; i != 256; ++i)
+		order[i] = (unsigned char)i;
+	for (i = 255; i != 0; --i) {
+		seed = seed * 1103515245 + 12345;
+		j = (unsigned int)((seed >> 16) % (i + 1));
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+}
+
+static void report(const char *name, unsigned int options, clock_t begin,
+		clock_t end, double ops, unsigned long check) {
+	double secs = (double)(end - begin) / CLOCKS_PER_SEC;
+
+	printf("%-10s %8u %12.2f %12.1f   (%lu)\n", name, options,
+			ops > 0 ? secs * 1e9 / ops : 0.0,
+			secs > 0 ? ops / secs / 1e6 : 0.0, check);
+}
+
+/* each negotiation reads the state, then writes it back twice as a
+ * WANTYES/YES transition does */
+static void bench_tables(unsigned int options) {
+	unsigned char order[256];
+	legacy_table_t legacy;
+	direct_table_t direct;
+	unsigned long check;
+	clock_t begin, end;
+	unsigned int c, r, i;
+	double ops = (double)CONNECTIONS * ROUNDS * options;
+
+	make_order(order);
+
+	check = 0;
+	begin = clock();
+	for (c = 0; c != CONNECTIONS; ++c) {
+		memset(&legacy, 0, sizeof(legacy));
+		for (r = 0; r != ROUNDS; ++r) {
+			for (i = 0; i != options; ++i) {
+				check += legacy_get(&legacy, order[i]);
+				legacy_set(&legacy, order[i], 3);
+				legacy_set(&legacy, order[i], (unsigned char)(r & 1));
+			}
+		}
+		free(legacy.q);
+	}
+	end = clock();
+	report("legacy", options, begin, end, ops, check);
+
+	check = 0;
+	begin = clock();
+	for (c = 0; c != CONNECTIONS; ++c) {
+		memset(&direct, 0, sizeof(direct));
+		for (r = 0; r != ROUNDS; ++r) {
+			for (i = 0; i != options; ++i) {
+				check += direct_get(&direct, order[i]);
+				direct_set(&direct, order[i], 3);
+				direct_set(&direct, order[i], (unsigned char)(r & 1));
+			}
+		}
+	}
+	end = clock();
+	report("direct", options, begin, end, ops, check);
+}
+
+static void event_count(telnet_t *telnet, telnet_event_t *ev, void *ud) {
+	unsigned long *count = (unsigned long *)ud;
+
+	(void)telnet;
+
+	if (ev->type == TELNET_EV_WILL || ev->type == TELNET_EV_DO ||
+			ev->type == TELNET_EV_WONT || ev->type == TELNET_EV_DONT)
+		++*count;
+}
+
+/* feed a client that offers and then withdraws every option it can name
+ * through a full state tracker */
+static void bench_recv(unsigned int options) {
+	static telnet_telopt_t telopts[257];
+	unsigned char order[256];
+	unsigned char *input;
+	unsigned long count = 0;
+	telnet_t *telnet;
+	clock_t begin, end;
+	size_t len = 0;
+	unsigned int s, i;
+
+	for (i = 0; i != 256; ++i) {
+		telopts[i].telopt = (short)i;
+		telopts[i].us = TELNET_WILL;
+		telopts[i].him = TELNET_DO;
+	}
+	telopts[256].telopt = -1;
+
+	make_order(order);
+	if ((input = (unsigned char *)malloc(options * 12)) == 0) {
+		fprintf(stderr, "malloc() failed\n");
+		exit(1);
+	}
+	for (i = 0; i != options; ++i) {
+		input[len++] = TELNET_IAC;
+		input[len++] = TELNET_WILL;
+		input[len++] = order[i];
+		input[len++] = TELNET_IAC;
+		input[len++] = TELNET_DO;
+		input[len++] = order[i];
+	}
+	for (i = 0; i != options; ++i) {
+		input[len++] = TELNET_IAC;
+		input[len++] = TELNET_WONT;
+		input[len++] = order[i];
+		input[len++] = TELNET_IAC;
+		input[len++] = TELNET_DONT;
+		input[len++] = order[i];
+	}
+
+	begin = clock();
+	for (s = 0; s != STORMS; ++s) {
+		if ((telnet = telnet_init(telopts, event_count, 0, &count)) == 0) {
+			fprintf(stderr, "telnet_init() failed\n");
+			exit(1);
+		}
+		telnet_recv(telnet, (const char *)input, len);
+		telnet_free(telnet);
+	}
+	end = clock();
+	report("recv", options, begin, end, (double)STORMS * options * 4,
+			count);
+
+	free(input);
+}
+
+int main(void) {
+	static const unsigned int options[] = { 4, 32, 128, 256 };
+	unsigned int i;
+
+	printf("%-10s %8s %12s %12s\n", "scheme", "options", "ns/op",
+			"Mops/s");
+	for (i = 0; i != sizeof(options) / sizeof(options[0]); ++i)
+		bench_tables(options[i]);
+	for (i = 0; i != sizeof(options) / sizeof(options[0]); ++i)
+		bench_recv(options[i]);
+
+	return 0;
+}
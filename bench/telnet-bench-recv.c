@@ -0,0 +1,340 @@
+/*
+ * Sean Middleditch
+ * sean@sourcemud.org
+ *
+ * The author or authors of this code dedicate any and all copyright interest
+ * in this code to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and successors. We
+ * intend this dedication to be an overt act of relinquishment in perpetuity of
+ * all present and future rights to this code under copyright law.
+ */
+
+/*
+ * Receive path benchmark: runs telnet_recv() over synthetic corpora, and
+ * over any recorded streams named on the command line, at several chunk
+ * sizes.  Usage: telnet-bench-recv [recorded-stream-file ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libtelnet.h"
+
+/* amount of payload in each synthetic corpus */
+#define CORPUS_SIZE (8 * 1024 * 1024)
+
+/* size of the coalescing buffer */
+#define DATA_BUFFER_SIZE 4096
+
+/* GMCP telopt; not one libtelnet knows about */
+#define TELOPT_GMCP 201
+
+typedef struct counters {
+	size_t events;
+	size_t bytes;
+	unsigned long sum;
+} counters_t;
+
+typedef struct corpus {
+	char *buffer;
+	size_t size;
+	size_t alloc;
+} corpus_t;
+
+static void event_count(telnet_t *telnet, telnet_event_t *ev, void *ud) {
+	counters_t *counters = (counters_t *)ud;
+
+	(void)telnet;
+
+	++counters->events;
+	if (ev->type == TELNET_EV_DATA) {
+		counters->bytes += ev->data.size;
+		/* touch the data so the work is not optimized away */
+		counters->sum += (unsigned char)ev->data.buffer[0];
+	} else if (ev->type == TELNET_EV_SUBNEGOTIATION && ev->sub.size != 0) {
+		counters->sum += (unsigned char)ev->sub.buffer[0];
+	}
+}
+
+static void corpus_append(corpus_t *corpus, const char *buffer,
+		size_t size) {
+	char *new_buffer;
+
+	if (corpus->size + size > corpus->alloc) {
+		corpus->alloc = (corpus->size + size) * 2;
+		if ((new_buffer = (char *)realloc(corpus->buffer,
+				corpus->alloc)) == 0) {
+			fprintf(stderr, "realloc() failed\n");
+			exit(1);
+		}
+		corpus->buffer = new_buffer;
+	}
+	memcpy(corpus->buffer + corpus->size, buffer, size);
+	corpus->size += size;
+}
+
+static unsigned long rand_next(unsigned long *seed) {
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 16;
+}
+
+/* printable text in 60-90 character lines, as a MUD sends */
+static void make_ascii(corpus_t *corpus) {
+	unsigned long seed = 12345;
+	char line[96];
+	size_t i, len;
+
+	while (corpus->size < CORPUS_SIZE) {
+		len = 60 + rand_next(&seed) % 31;
+		for (i = 0; i != len; ++i)
+			line[i] = (char)(' ' + rand_next(&seed) % 95);
+		line[len++] = '\r';
+		line[len++] = '\n';
+		corpus_append(corpus, line, len);
+	}
+}
+
+/* an escaped binary stream where roughly one byte in every iac_ratio is
+ * 0xFF */
+static void make_binary(corpus_t *corpus, unsigned int iac_ratio) {
+	static const char iac_iac[2] = { (char)TELNET_IAC, (char)TELNET_IAC };
+	unsigned long seed = 12345;
+	unsigned char byte;
+	char c;
+	size_t i;
+
+	for (i = 0; i != CORPUS_SIZE; ++i) {
+		if (rand_next(&seed) % iac_ratio == 0) {
+			corpus_append(corpus, iac_iac, 2);
+		} else {
+			byte = (unsigned char)(seed >> 8);
+			c = (char)(byte == TELNET_IAC ? 0 : byte);
+			corpus_append(corpus, &c, 1);
+		}
+	}
+}
+
+/* short NVT lines, each ending in CR LF or now and then CR NUL, as typed
+ * input looks */
+static void make_nvt(corpus_t *corpus) {
+	unsigned long seed = 12345;
+	char line[16];
+	size_t i, len;
+
+	while (corpus->size < CORPUS_SIZE) {
+		len = 1 + rand_next(&seed) % 12;
+		for (i = 0; i != len; ++i)
+			line[i] = (char)('a' + rand_next(&seed) % 26);
+		line[len++] = '\r';
+		line[len++] = rand_next(&seed) % 8 == 0 ? '\0' : '\n';
+		corpus_append(corpus, line, len);
+	}
+}
+
+/* GMCP messages, filled in with a couple of numbers */
+static const char *const gmcp_packages[] = {
+	"Char.Vitals {\"hp\":%lu,\"maxhp\":1000,\"mp\":%lu,\"maxmp\":500}",
+	"Room.Info {\"num\":%lu,\"name\":\"A dusty road\",\"exits\":"
+			"{\"n\":%lu,\"s\":12}}",
+	"Comm.Channel.Text {\"channel\":\"ooc\",\"talker\":\"Someone\","
+			"\"text\":\"hello there %lu %lu\"}",
+};
+
+static const char gmcp_text[] = "You walk down the dusty road.\r\n";
+
+static int gmcp_message(char *buffer, unsigned long *seed) {
+	const char *package = gmcp_packages[rand_next(seed) % 3];
+	unsigned long a = rand_next(seed) % 1000;
+	unsigned long b = rand_next(seed) % 1000;
+
+	return sprintf(buffer, package, a, b);
+}
+
+/* GMCP-like traffic: a few JSON subnegotiations for every line of text */
+static void make_gmcp(corpus_t *corpus) {
+	unsigned long seed = 12345;
+	char sb[256];
+	int len;
+
+	while (corpus->size < CORPUS_SIZE) {
+		sb[0] = (char)TELNET_IAC;
+		sb[1] = (char)TELNET_SB;
+		sb[2] = (char)TELOPT_GMCP;
+		len = gmcp_message(sb + 3, &seed);
+		sb[3 + len] = (char)TELNET_IAC;
+		sb[4 + len] = (char)TELNET_SE;
+		corpus_append(corpus, sb, (size_t)len + 5);
+		if (rand_next(&seed) % 3 == 0)
+			corpus_append(corpus, gmcp_text, sizeof(gmcp_text) - 1);
+	}
+}
+
+typedef struct compress_sink {
+	corpus_t *corpus;
+	int compressing;
+} compress_sink_t;
+
+static void compress_send(telnet_t *telnet, telnet_event_t *ev,
+		void *ud) {
+	compress_sink_t *sink = (compress_sink_t *)ud;
+
+	(void)telnet;
+
+	if (ev->type == TELNET_EV_SEND)
+		corpus_append(sink->corpus, ev->data.buffer, ev->data.size);
+	else if (ev->type == TELNET_EV_COMPRESS)
+		sink->compressing = ev->compress.state;
+}
+
+/* an MCCP2 stream of text lines and GMCP messages, compressed by
+ * libtelnet itself the way a server sends it; returns zero if there is
+ * no zlib support
+ */
+static int make_mccp2(corpus_t *corpus, const corpus_t *ascii) {
+	compress_sink_t sink;
+	telnet_t *telnet;
+	unsigned long seed = 12345;
+	char sb[256];
+	size_t i, sent;
+	int len;
+
+	sink.corpus = corpus;
+	sink.compressing = 0;
+	if ((telnet = telnet_init(0, compress_send, 0, &sink)) == 0) {
+		fprintf(stderr, "telnet_init() failed\n");
+		exit(1);
+	}
+
+	telnet_begin_compress2(telnet);
+	if (!sink.compressing) {
+		telnet_free(telnet);
+		return 0;
+	}
+
+	/* sync flush in server-sized writes rather than every call */
+	telnet_set_compress_flush(telnet, 4096);
+	for (i = sent = 0; sent < CORPUS_SIZE; i += 256) {
+		if (i + 256 > ascii->size)
+			i = 0;
+		telnet_send(telnet, ascii->buffer + i, 256);
+		len = gmcp_message(sb, &seed);
+		telnet_subnegotiation(telnet, TELOPT_GMCP, sb, (size_t)len);
+		sent += 256 + (size_t)len + 5;
+	}
+	telnet_end_compress2(telnet);
+	telnet_free(telnet);
+	return 1;
+}
+
+static void run(const char *name, const char *mode, unsigned char flags,
+		const char *input, size_t size, size_t chunk, int coalesce) {
+	telnet_t *telnet;
+	counters_t counters;
+	clock_t begin, end;
+	double secs, mb;
+	size_t i, len;
+
+	memset(&counters, 0, sizeof(counters));
+	if ((telnet = telnet_init(0, event_count, flags, &counters)) == 0) {
+		fprintf(stderr, "telnet_init() failed\n");
+		exit(1);
+	}
+	if (coalesce && telnet_set_data_buffer(telnet, 0, DATA_BUFFER_SIZE) !=
+			TELNET_EOK) {
+		fprintf(stderr, "telnet_set_data_buffer() failed\n");
+		exit(1);
+	}
+
+	begin = clock();
+	for (i = 0; i < size; i += len) {
+		len = size - i < chunk ? size - i : chunk;
+		telnet_recv(telnet, input + i, len);
+	}
+	end = clock();
+
+	telnet_free(telnet);
+
+	secs = (double)(end - begin) / CLOCKS_PER_SEC;
+	mb = (double)size / (1024.0 * 1024.0);
+	printf("%-14s %-9s %7lu %10.1f %14.0f %10.2f\n", name, mode,
+			(unsigned long)chunk, secs > 0 ? mb / secs : 0.0,
+			secs > 0 ? (double)counters.events / secs : 0.0,
+			secs > 0 ? secs * 1e9 / (double)size : 0.0);
+}
+
+/* read a recorded stream from disk */
+static int load(corpus_t *corpus, const char *path) {
+	char buffer[65536];
+	size_t len;
+	FILE *fh;
+
+	if ((fh = fopen(path, "rb")) == 0) {
+		perror(path);
+		return 0;
+	}
+	while ((len = fread(buffer, 1, sizeof(buffer), fh)) != 0)
+		corpus_append(corpus, buffer, len);
+	fclose(fh);
+	return 1;
+}
+
+static void run_chunks(const char *name, const char *mode,
+		unsigned char flags, const corpus_t *corpus, int coalesce) {
+	static const size_t chunks[] = { 64, 512, 4096, 65536 };
+	size_t i;
+
+	for (i = 0; i != sizeof(chunks) / sizeof(chunks[0]); ++i)
+		run(name, mode, flags, corpus->buffer, corpus->size, chunks[i],
+				coalesce);
+}
+
+int main(int argc, char **argv) {
+	corpus_t ascii, binary, dense, nvt, gmcp, mccp2, recorded;
+	int i;
+
+	memset(&ascii, 0, sizeof(ascii));
+	memset(&binary, 0, sizeof(binary));
+	memset(&dense, 0, sizeof(dense));
+	memset(&nvt, 0, sizeof(nvt));
+	memset(&gmcp, 0, sizeof(gmcp));
+	memset(&mccp2, 0, sizeof(mccp2));
+
+	make_ascii(&ascii);
+	make_binary(&binary, 256);
+	make_binary(&dense, 4);
+	make_nvt(&nvt);
+	make_gmcp(&gmcp);
+
+	printf("%-14s %-9s %7s %10s %14s %10s\n", "corpus", "mode", "chunk",
+			"MB/s", "events/s", "ns/byte");
+	run_chunks("ascii", "default", 0, &ascii, 0);
+	run_chunks("binary", "default", 0, &binary, 0);
+	run_chunks("binary", "coalesce", 0, &binary, 1);
+	run_chunks("iac-dense", "default", 0, &dense, 0);
+	run_chunks("iac-dense", "coalesce", 0, &dense, 1);
+	run_chunks("nvt-crlf", "nvt-eol", TELNET_FLAG_NVT_EOL, &nvt, 0);
+	run_chunks("nvt-crlf", "coalesce", TELNET_FLAG_NVT_EOL, &nvt, 1);
+	run_chunks("gmcp", "default", 0, &gmcp, 0);
+	if (make_mccp2(&mccp2, &ascii))
+		run_chunks("mccp2", "default", 0, &mccp2, 0);
+	else
+		printf("%-14s (no zlib support)\n", "mccp2");
+
+	/* recorded streams are replayed as they are */
+	for (i = 1; i < argc; ++i) {
+		memset(&recorded, 0, sizeof(recorded));
+		if (load(&recorded, argv[i]))
+			run_chunks(argv[i], "recorded", 0, &recorded, 0);
+		free(recorded.buffer);
+	}
+
+	free(ascii.buffer);
+	free(binary.buffer);
+	free(dense.buffer);
+	free(nvt.buffer);
+	free(gmcp.buffer);
+	free(mccp2.buffer);
+	return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * Sean Middleditch
+ * sean@sourcemud.org
+ *
+ * The author or authors of this code dedicate any and all copyright interest
+ * in this code to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and successors. We
+ * intend this dedication to be an overt act of relinquishment in perpetuity of
+ * all present and future rights to this code under copyright law.
+ */
+
+/*
+ * Send path benchmark: times the send functions against an event handler
+ * that only counts, so the numbers are library cost without any I/O.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libtelnet.h"
+
+/* logical messages sent per case */
+#define MESSAGES 1000000
+
+/* GMCP telopt; not one libtelnet knows about */
+#define TELOPT_GMCP 201
+
+/* size of the output buffer in buffered mode */
+#define SEND_BUFFER_SIZE 4096
+
+/* ways of running each case */
+#define MODE_PLAIN 0
+#define MODE_BUFFERED 1
+#define MODE_MCCP2 2
+
+typedef struct counters {
+	size_t sends;
+	size_t bytes;
+	unsigned long sum;
+} counters_t;
+
+typedef void (*send_fn_t)(telnet_t *telnet, unsigned long i);
+
+static const char text[] =
+		"The quick brown fox jumps over the lazy dog.\r\n"
+		"A second line of text follows the first one\n";
+
+static const char binary[] =
+		"binary\377data\377with\377\377escapes\001\002\003\004\005\006";
+
+static const char gmcp[] =
+		"Char.Vitals {\"hp\":950,\"maxhp\":1000,\"mp\":410,\"maxmp\":500}";
+
+static void event_count(telnet_t *telnet, telnet_event_t *ev, void *ud) {
+	counters_t *counters = (counters_t *)ud;
+	size_t i;
+
+	(void)telnet;
+
+	if (ev->type == TELNET_EV_SEND) {
+		++counters->sends;
+		counters->bytes += ev->data.size;
+		/* touch the data so the work is not optimized away */
+		counters->sum += (unsigned char)ev->data.buffer[0];
+	} else if (ev->type == TELNET_EV_SENDV) {
+		++counters->sends;
+		for (i = 0; i != ev->sendv.count; ++i)
+			counters->bytes += ev->sendv.iov[i].size;
+	}
+}
+
+static void send_plain(telnet_t *telnet, unsigned long i) {
+	(void)i;
+	telnet_send(telnet, text, sizeof(text) - 1);
+}
+
+static void send_binary(telnet_t *telnet, unsigned long i) {
+	(void)i;
+	telnet_send(telnet, binary, sizeof(binary) - 1);
+}
+
+static void send_text(telnet_t *telnet, unsigned long i) {
+	(void)i;
+	telnet_send_text(telnet, text, sizeof(text) - 1);
+}
+
+static void send_printf(telnet_t *telnet, unsigned long i) {
+	telnet_printf(telnet, "You have %lu gold coins and %d items.\n",
+			i, (int)(i & 31));
+}
+
+static void send_zmp(telnet_t *telnet, unsigned long i) {
+	static const char *argv[] = { "zmp.ping", "2024-01-01 12:00:00",
+			"extra" };
+
+	(void)i;
+	telnet_send_zmp(telnet, 3, argv);
+}
+
+static void send_newenviron(telnet_t *telnet, unsigned long i) {
+	(void)i;
+	telnet_begin_newenviron(telnet, TELNET_ENVIRON_IS);
+	telnet_newenviron_value(telnet, TELNET_ENVIRON_VAR, "USER");
+	telnet_newenviron_value(telnet, TELNET_ENVIRON_VALUE, "someone");
+	telnet_newenviron_value(telnet, TELNET_ENVIRON_USERVAR, "TERM");
+	telnet_newenviron_value(telnet, TELNET_ENVIRON_VALUE, "xterm-256color");
+	telnet_finish_newenviron(telnet);
+}
+
+static void send_subnegotiation(telnet_t *telnet, unsigned long i) {
+	(void)i;
+	telnet_subnegotiation(telnet, TELOPT_GMCP, gmcp, sizeof(gmcp) - 1);
+}
+
+static void run(const char *name, send_fn_t fn, int mode) {
+	static const char *const mode_names[] = { "plain", "buffered",
+			"mccp2" };
+	telnet_t *telnet;
+	counters_t counters;
+	clock_t begin, end;
+	double secs;
+	unsigned long i;
+
+	memset(&counters, 0, sizeof(counters));
+	if ((telnet = telnet_init(0, event_count, 0, &counters)) == 0) {
+		fprintf(stderr, "telnet_init() failed\n");
+		exit(1);
+	}
+	if (mode == MODE_BUFFERED && telnet_set_send_buffer(telnet,
+			SEND_BUFFER_SIZE) != TELNET_EOK) {
+		fprintf(stderr, "telnet_set_send_buffer() failed\n");
+		exit(1);
+	}
+	if (mode == MODE_MCCP2) {
+		telnet_begin_compress2(telnet);
+		/* leave out the marker */
+		memset(&counters, 0, sizeof(counters));
+	}
+
+	/* in buffered mode each message is flushed, as a server does once
+	 * it has written a reply */
+	begin = clock();
+	if (mode == MODE_BUFFERED) {
+		for (i = 0; i != MESSAGES; ++i) {
+			fn(telnet, i);
+			telnet_flush(telnet);
+		}
+	} else {
+		for (i = 0; i != MESSAGES; ++i)
+			fn(telnet, i);
+	}
+	end = clock();
+
+	telnet_free(telnet);
+
+	secs = (double)(end - begin) / CLOCKS_PER_SEC;
+	printf("%-16s %-8s %10.1f %12.3f %12.1f\n", name,
+			mode_names[mode], secs * 1e9 / MESSAGES,
+			(double)counters.sends / MESSAGES,
+			(double)counters.bytes / MESSAGES);
+}
+
+/* check whether telnet_begin_compress2() does anything in this build */
+static void compress_seen(telnet_t *telnet, telnet_event_t *ev, void *ud) {
+	(void)telnet;
+
+	if (ev->type == TELNET_EV_COMPRESS)
+		*(int *)ud = 1;
+}
+
+static int have_zlib(void) {
+	telnet_t *telnet;
+	int seen = 0;
+
+	if ((telnet = telnet_init(0, compress_seen, 0, &seen)) == 0) {
+		fprintf(stderr, "telnet_init() failed\n");
+		exit(1);
+	}
+	telnet_begin_compress2(telnet);
+	telnet_free(telnet);
+	return seen;
+}
+
+int main(void) {
+	static const struct {
+		const char *name;
+		send_fn_t fn;
+	} cases[] = {
+		{ "send", send_plain },
+		{ "send-binary", send_binary },
+		{ "send_text", send_text },
+		{ "printf", send_printf },
+		{ "send_zmp", send_zmp },
+		{ "newenviron", send_newenviron },
+		{ "subnegotiation", send_subnegotiation },
+	};
+	int compress = have_zlib();
+	size_t i;
+
+	printf("%-16s %-8s %10s %12s %12s\n", "function", "mode", "ns/msg",
+			"sends/msg", "bytes/msg");
+	for (i = 0; i != sizeof(cases) / sizeof(cases[0]); ++i) {
+		run(cases[i].name, cases[i].fn, MODE_PLAIN);
+		run(cases[i].name, cases[i].fn, MODE_BUFFERED);
+		if (compress)
+			run(cases[i].name, cases[i].fn, MODE_MCCP2);
+	}
+
+	return 0;
+}
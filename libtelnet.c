@@ -17,6 +17,7 @@
 #include <errno.h>
 #include <string.h>
 #include <stdarg.h>
+#include <limits.h>
 
 /* Win32 compatibility */
 #if defined(_WIN32)
@@ -38,6 +39,29 @@
 # include <zlib.h>
 #endif
 
+/* SIMD support for scanning runs of plain data; SSE2 is part of the
+ * x86-64 baseline, AVX2 is selected at runtime, NEON is always present
+ * on the ARM targets that advertise it
+ */
+#if defined(__SSE2__) || defined(_M_X64) || \
+		(defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define TELNET_SIMD_SSE2 1
+# include <emmintrin.h>
+#endif
+#if defined(TELNET_SIMD_SSE2) && defined(__GNUC__) && \
+		(defined(__x86_64__) || defined(__i386__)) && \
+		(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+# define TELNET_SIMD_AVX2 1
+# include <immintrin.h>
+#endif
+#if (defined(__ARM_NEON) || defined(__ARM_NEON__)) && defined(__GNUC__)
+# define TELNET_SIMD_NEON 1
+# include <arm_neon.h>
+#endif
+#if defined(_MSC_VER) && defined(TELNET_SIMD_SSE2)
+# include <intrin.h>
+#endif
+
 #include "libtelnet.h"
 
 /* inlinable functions */
@@ -47,6 +71,15 @@
 # define INLINE
 #endif
 
+/* functions that must be inlined to be specialized for their arguments */
+#if defined(__GNUC__)
+# define FORCE_INLINE __inline__ __attribute__((always_inline))
+#elif defined(_MSC_VER)
+# define FORCE_INLINE __forceinline
+#else
+# define FORCE_INLINE INLINE
+#endif
+
 /* helper for Q-method option tracking */
 #define Q_US(q) ((q).state & 0x0F)
 #define Q_HIM(q) (((q).state & 0xF0) >> 4)
@@ -56,7 +89,7 @@
 #define NEGOTIATE_EVENT(telnet,cmd,opt) \
 	ev.type = (cmd); \
 	ev.neg.telopt = (opt); \
-	(telnet)->eh((telnet), &ev, (telnet)->ud);
+	_event((telnet), &ev);
 
 /* telnet state codes */
 enum telnet_state_t {
@@ -77,32 +110,144 @@ typedef enum telnet_state_t telnet_state_t;
 struct telnet_t {
 	/* user data */
 	void *ud;
-	/* telopt support table */
-	const telnet_telopt_t *telopts;
+	/* telopts we support locally, one bit per telopt */
+	unsigned char telopt_us[32];
+	/* telopts we support on the remote end, one bit per telopt */
+	unsigned char telopt_him[32];
 	/* event handler */
 	telnet_event_handler_t eh;
+	/* statistics counters, see telnet_get_stats() */
+	telnet_stats_t stats;
+	/* memory allocator, see telnet_init_ex() */
+	telnet_allocator_t allocator;
 #if defined(HAVE_ZLIB)
-	/* zlib (mccp2) compression */
-	z_stream *z;
+	/* zlib (mccp2/mccp3) compression of output */
+	z_stream *z_out;
+	/* zlib decompression of input */
+	z_stream *z_in;
+	/* reset streams kept by telnet_reset() for the next connection */
+	z_stream *z_out_spare;
+	z_stream *z_in_spare;
+	/* telopt of the compressed output stream, COMPRESS2 or COMPRESS3 */
+	unsigned char z_out_telopt;
+	/* telopt of the compressed input stream */
+	unsigned char z_in_telopt;
+	/* bytes to compress before a sync flush; 0 to flush every write */
+	size_t z_flush;
+	/* bytes compressed since the last sync flush */
+	size_t z_pending;
+	/* deflateInit2() parameters */
+	int z_level;
+	int z_window_bits;
+	int z_mem_level;
+	int z_strategy;
+	/* buffer decompressed input is parsed from */
+	char *inflate;
+	/* size of the inflate buffer as allocated */
+	size_t inflate_alloc;
+	/* size the inflate buffer should be */
+	size_t inflate_size;
+	/* decompressed bytes not yet parsed, from inflate_pos up to
+	 * inflate_end, when parsing stopped part way through them */
+	size_t inflate_pos;
+	size_t inflate_end;
+	/* compressed bytes zlib has consumed but telnet_recv_partial() has
+	 * not reported as consumed, as their output is not yet parsed; they
+	 * are skipped when passed in again */
+	size_t inflate_held;
+	/* non-zero if zlib may have output left that did not fit */
+	unsigned char inflate_more;
+	/* non-zero once the compressed input has ended; the stream is torn
+	 * down after the last decompressed bytes are parsed */
+	unsigned char z_in_end;
+	/* adaptive compression thresholds, see telnet_set_compress_adaptive() */
+	size_t za_window;
+	size_t za_flush;
+	size_t za_restart;
+	unsigned int za_ratio;
+	/* uncompressed and compressed bytes, and flushes, this window */
+	size_t za_in;
+	size_t za_out;
+	unsigned int za_flushes;
+	/* non-zero if adaptive compression has ended the stream */
+	unsigned char za_off;
+	/* application memory hooks for zlib, see telnet_set_compress_alloc() */
+	telnet_zalloc_t z_alloc;
+	telnet_zfree_t z_free;
+	void *z_opaque;
 #endif
-	/* RFC1143 option negotiation states */
-	struct telnet_rfc1143_t *q;
 	/* sub-request buffer */
 	char *buffer;
 	/* current size of the buffer */
 	size_t buffer_size;
 	/* current buffer write position (also length of buffer data) */
 	size_t buffer_pos;
+	/* size of the first buffer allocation */
+	size_t buffer_initial;
+	/* hard limit on the buffer size */
+	size_t buffer_max;
+	/* factor the buffer grows by */
+	unsigned int buffer_growth;
+	/* small subnegotiations to see before shrinking; 0 to never shrink */
+	unsigned int buffer_shrink;
+	/* consecutive subnegotiations that fit in the initial size */
+	unsigned int buffer_small;
+	/* received data coalescing buffer, see telnet_set_data_buffer() */
+	char *data;
+	/* size of the coalescing buffer; zero if coalescing is disabled */
+	size_t data_size;
+	/* number of unescaped bytes waiting in the coalescing buffer */
+	size_t data_pos;
+	/* output coalescing buffer, see telnet_set_send_buffer() */
+	char *send;
+	/* size of the output buffer; zero if output is not buffered */
+	size_t send_size;
+	/* number of bytes waiting in the output buffer */
+	size_t send_pos;
+	/* buffer kept for formatting output too long for the stack */
+	char *fmt;
+	/* size of the formatting buffer */
+	size_t fmt_size;
+	/* scratch space for the arrays and strings the subnegotiation
+	 * parsers hand to events, see _scratch() */
+	void *scratch;
+	/* size of the scratch space */
+	size_t scratch_size;
+	/* subnegotiation parsers indexed by telopt; 0 until the application
+	 * sets one, which stands for the built in parsers */
+	struct telnet_sb_entry_t *sb_parsers;
+	/* events waiting to be pulled, see telnet_next_event() */
+	struct telnet_pull_t *pull;
+	/* input given to telnet_feed() and not parsed yet */
+	const char *feed;
+	size_t feed_size;
 	/* current state */
 	enum telnet_state_t state;
 	/* option flags */
 	unsigned char flags;
 	/* current subnegotiation telopt */
 	unsigned char sb_telopt;
-	/* length of RFC1143 queue */
-	unsigned int q_size;
-	/* number of entries in RFC1143 queue */
-	unsigned int q_cnt;
+	/* non-zero if the coalescing buffer was allocated by libtelnet */
+	unsigned char data_owned;
+	/* non-zero if the structure lives in memory from the application,
+	 * see telnet_init_inplace() */
+	unsigned char inplace;
+	/* non-zero while parsing for telnet_next_event() */
+	unsigned char pulling;
+	/* non-zero to make the parser stop at the next byte boundary */
+	unsigned char stop;
+	/* non-zero once the event handler called telnet_pause() */
+	unsigned char paused;
+	/* non-zero while a subnegotiation is handed to its event and parser,
+	 * which may still be reading the buffer and scratch space */
+	unsigned char in_sb;
+	/* event types not to raise, see telnet_set_event_mask() */
+	unsigned int event_mask;
+	/* non-zero if TELNET_EV_SUBNEGOTIATION is masked, which only holds
+	 * for telopts with a parser and so is kept out of event_mask */
+	unsigned char sb_masked;
+	/* RFC1143 option negotiation states, indexed by telopt */
+	unsigned char q[256];
 };
 
 /* RFC1143 option negotiation state */
@@ -111,6 +256,47 @@ typedef struct telnet_rfc1143_t {
 	unsigned char state;
 } telnet_rfc1143_t;
 
+/* size of the buffer error and warning messages are formatted into */
+#define ERROR_MSG_SIZE 512
+
+/* most events the parser can raise before it gets to stop; see
+ * _pull_event() */
+#define PULL_QUEUE_SIZE 8
+
+/* events raised while parsing for telnet_next_event(), with storage for
+ * their messages */
+typedef struct telnet_pull_t {
+	telnet_event_t ev[PULL_QUEUE_SIZE];
+	char msg[PULL_QUEUE_SIZE][ERROR_MSG_SIZE];
+	/* the application's event handler, which output still goes to */
+	telnet_event_handler_t eh;
+	/* number of events queued since the parser last ran, and the next
+	 * of them to hand out */
+	size_t count;
+	size_t next;
+} telnet_pull_t;
+
+/* a subnegotiation parser and its context, see telnet_set_sb_parser() */
+typedef struct telnet_sb_entry_t {
+	telnet_sb_parser_t parser;
+	void *ctx;
+} telnet_sb_entry_t;
+
+/* default size of the buffer compressed input is inflated into */
+#define INFLATE_BUFFER_SIZE 16384
+
+/* smallest buffer used to format telnet_printf() output */
+#define FORMAT_BUFFER_SIZE 1024
+
+/* size of the staging buffer used to escape outgoing data */
+#define ENCODE_BUFFER_SIZE 1024
+
+/* largest number of entries in a SENDV event */
+#define SENDV_IOV_MAX 64
+
+/* smallest allocation of the subnegotiation parser scratch space */
+#define SCRATCH_SIZE_MIN 256
+
 /* RFC1143 state names */
 #define Q_NO 0
 #define Q_YES 1
@@ -119,125 +305,530 @@ typedef struct telnet_rfc1143_t {
 #define Q_WANTNO_OP 4
 #define Q_WANTYES_OP 5
 
-/* telnet NVT EOL sequences */
-static const char CRLF[] = { '\r', '\n' };
-static const char CRNUL[] = { '\r', '\0' };
+/* default subnegotiation buffer sizing: 512, 2048, 8192, 16384 */
+#define SB_BUFFER_INITIAL 512
+#define SB_BUFFER_GROWTH 4
+#define SB_BUFFER_MAX 16384
+
+/* index of the lowest set bit in a non-zero SIMD compare mask */
+#if defined(_MSC_VER) && defined(TELNET_SIMD_SSE2)
+static INLINE size_t _mask_index(unsigned int mask) {
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+}
+#elif defined(__GNUC__)
+# define _mask_index(mask) ((size_t)__builtin_ctz(mask))
+#endif
+
+/* scan for the first byte equal to a, b or c, returning size if there
+ * is none; the portable version is also used for short tails.  callers
+ * looking for fewer special bytes repeat one of them.
+ */
+static INLINE size_t _scan_scalar(const unsigned char *buffer, size_t size,
+		unsigned char a, unsigned char b, unsigned char c) {
+	const unsigned char *p;
+	size_t i;
+
+	/* a single special byte is exactly what memchr() is tuned for */
+	if (a == b && a == c) {
+		p = (const unsigned char *)memchr(buffer, a, size);
+		return p != 0 ? (size_t)(p - buffer) : size;
+	}
+
+	for (i = 0; i != size; ++i) {
+		if (buffer[i] == a || buffer[i] == b || buffer[i] == c)
+			break;
+	}
+	return i;
+}
+
+#if defined(TELNET_SIMD_SSE2)
+/* see _scan_scalar; compares 16 bytes per step */
+static size_t _scan_sse2(const unsigned char *buffer, size_t size,
+		unsigned char a, unsigned char b, unsigned char c) {
+	const __m128i va = _mm_set1_epi8((char)a);
+	const __m128i vb = _mm_set1_epi8((char)b);
+	const __m128i vc = _mm_set1_epi8((char)c);
+	__m128i v;
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; i + 16 <= size; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(buffer + i));
+		mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+				_mm_cmpeq_epi8(v, vc)));
+		if (mask != 0)
+			return i + _mask_index(mask);
+	}
+
+	return i + _scan_scalar(buffer + i, size - i, a, b, c);
+}
+#endif /* defined(TELNET_SIMD_SSE2) */
+
+#if defined(TELNET_SIMD_AVX2)
+/* see _scan_scalar; compares 32 bytes per step, only called once the
+ * CPU has been confirmed to support AVX2
+ */
+__attribute__((target("avx2")))
+static size_t _scan_avx2(const unsigned char *buffer, size_t size,
+		unsigned char a, unsigned char b, unsigned char c) {
+	const __m256i va = _mm256_set1_epi8((char)a);
+	const __m256i vb = _mm256_set1_epi8((char)b);
+	const __m256i vc = _mm256_set1_epi8((char)c);
+	__m256i v;
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; i + 32 <= size; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(buffer + i));
+		mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+				_mm256_cmpeq_epi8(v, vb)), _mm256_cmpeq_epi8(v, vc)));
+		if (mask != 0)
+			return i + _mask_index(mask);
+	}
+
+	return i + _scan_sse2(buffer + i, size - i, a, b, c);
+}
+#endif /* defined(TELNET_SIMD_AVX2) */
+
+#if defined(TELNET_SIMD_NEON)
+/* see _scan_scalar; compares 16 bytes per step.  NEON has no movemask,
+ * so the compare result is narrowed to one nibble per byte instead.
+ */
+static size_t _scan_neon(const unsigned char *buffer, size_t size,
+		unsigned char a, unsigned char b, unsigned char c) {
+	const uint8x16_t va = vdupq_n_u8(a);
+	const uint8x16_t vb = vdupq_n_u8(b);
+	const uint8x16_t vc = vdupq_n_u8(c);
+	uint8x16_t v;
+	uint64_t mask;
+	size_t i;
+
+	for (i = 0; i + 16 <= size; i += 16) {
+		v = vld1q_u8(buffer + i);
+		v = vorrq_u8(vorrq_u8(vceqq_u8(v, va), vceqq_u8(v, vb)),
+				vceqq_u8(v, vc));
+		mask = vget_lane_u64(vreinterpret_u64_u8(
+				vshrn_n_u16(vreinterpretq_u16_u8(v), 4)), 0);
+		if (mask != 0)
+			return i + ((size_t)__builtin_ctzll(mask) >> 2);
+	}
+
+	return i + _scan_scalar(buffer + i, size - i, a, b, c);
+}
+#endif /* defined(TELNET_SIMD_NEON) */
+
+/* find the first byte in buffer equal to a, b or c, using the widest
+ * vector unit the running CPU supports; returns size if not found
+ */
+static INLINE size_t _scan(const char *buffer, size_t size,
+		unsigned char a, unsigned char b, unsigned char c) {
+	const unsigned char *ubuffer = (const unsigned char *)buffer;
+
+	/* short runs are not worth the vector setup */
+	if (size < 16)
+		return _scan_scalar(ubuffer, size, a, b, c);
+
+#if defined(TELNET_SIMD_AVX2)
+	if (size >= 32 && __builtin_cpu_supports("avx2"))
+		return _scan_avx2(ubuffer, size, a, b, c);
+#endif
+#if defined(TELNET_SIMD_SSE2)
+	return _scan_sse2(ubuffer, size, a, b, c);
+#elif defined(TELNET_SIMD_NEON)
+	return _scan_neon(ubuffer, size, a, b, c);
+#else
+	return _scan_scalar(ubuffer, size, a, b, c);
+#endif
+}
+
+/* default allocator hooks */
+static void *_libc_malloc(void *ctx, size_t size) {
+	(void)ctx;
+	return malloc(size);
+}
+
+static void *_libc_realloc(void *ctx, void *ptr, size_t size) {
+	(void)ctx;
+	return realloc(ptr, size);
+}
+
+static void _libc_free(void *ctx, void *ptr) {
+	(void)ctx;
+	free(ptr);
+}
+
+/* allocate memory through the connection's allocator */
+static INLINE void *_malloc(telnet_t *telnet, size_t size) {
+	return telnet->allocator.malloc_hook(telnet->allocator.ctx, size);
+}
+
+/* release memory through the connection's allocator; ptr may be 0 */
+static INLINE void _free(telnet_t *telnet, void *ptr) {
+	if (ptr != 0)
+		telnet->allocator.free_hook(telnet->allocator.ctx, ptr);
+}
+
+/* resize a block of old_size bytes; an allocator without a realloc hook
+ * gets a new block, and the bytes are copied over
+ */
+static void *_realloc(telnet_t *telnet, void *ptr, size_t old_size,
+		size_t size) {
+	void *new_ptr;
 
-/* buffer sizes */
-static const size_t _buffer_sizes[] = { 0, 512, 2048, 8192, 16384, };
-static const size_t _buffer_sizes_count = sizeof(_buffer_sizes) /
-		sizeof(_buffer_sizes[0]);
+	if (telnet->allocator.realloc_hook != 0)
+		return telnet->allocator.realloc_hook(telnet->allocator.ctx, ptr,
+				size);
 
-/* RFC1143 option negotiation state table allocation quantum */
-#define Q_BUFFER_GROWTH_QUANTUM 4
+	if ((new_ptr = _malloc(telnet, size)) == 0)
+		return 0;
+	if (ptr != 0) {
+		memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+		_free(telnet, ptr);
+	}
+	return new_ptr;
+}
+
+/* hand an event to the application */
+static INLINE void _event(telnet_t *telnet, telnet_event_t *ev) {
+	if (telnet->event_mask & TELNET_EV_MASK(ev->type))
+		return;
+	++telnet->stats.events[ev->type];
+	telnet->eh(telnet, ev, telnet->ud);
+}
 
 /* error generation function */
 static telnet_error_t _error(telnet_t *telnet, unsigned line,
 		const char* func, telnet_error_t err, int fatal, const char *fmt,
 		...) {
 	telnet_event_t ev;
-	char buffer[512];
+	char buffer[ERROR_MSG_SIZE];
 	va_list va;
 
+	/* no need to format a message nobody sees */
+	ev.type = fatal ? TELNET_EV_ERROR : TELNET_EV_WARNING;
+	if (telnet->event_mask & TELNET_EV_MASK(ev.type))
+		return err;
+
 	/* format informational text */
 	va_start(va, fmt);
 	vsnprintf(buffer, sizeof(buffer), fmt, va);
 	va_end(va);
 
 	/* send error event to the user */
-	ev.type = fatal ? TELNET_EV_ERROR : TELNET_EV_WARNING;
 	ev.error.file = __FILE__;
 	ev.error.func = func;
 	ev.error.line = line;
 	ev.error.msg = buffer;
-	telnet->eh(telnet, &ev, telnet->ud);
+	_event(telnet, &ev);
 
 	return err;
 }
 
 #if defined(HAVE_ZLIB)
-/* initialize the zlib box for a telnet box; if deflate is non-zero, it
- * initializes zlib for delating (compression), otherwise for inflating
- * (decompression).  returns TELNET_EOK on success, something else on
- * failure.
+/* zlib memory hooks that use the connection's allocator */
+static voidpf _zalloc(voidpf opaque, uInt items, uInt size) {
+	if (size != 0 && items > (size_t)-1 / size)
+		return Z_NULL;
+	return _malloc((telnet_t *)opaque, (size_t)items * size);
+}
+
+static void _zfree(voidpf opaque, voidpf address) {
+	_free((telnet_t *)opaque, address);
+}
+
+/* release the memory of a z_stream */
+static void _free_zstream(telnet_t *telnet, z_stream *z) {
+	if (telnet->z_free != 0)
+		telnet->z_free(telnet->z_opaque, z);
+	else
+		_free(telnet, z);
+}
+
+/* tear down the compression (deflate non-zero) or decompression zlib
+ * box */
+static void _free_zlib(telnet_t *telnet, int deflate) {
+	if (deflate) {
+		deflateEnd(telnet->z_out);
+		_free_zstream(telnet, telnet->z_out);
+		telnet->z_out = 0;
+		telnet->z_pending = 0;
+	} else {
+		inflateEnd(telnet->z_in);
+		_free_zstream(telnet, telnet->z_in);
+		telnet->z_in = 0;
+		telnet->z_in_end = 0;
+		telnet->inflate_pos = 0;
+		telnet->inflate_end = 0;
+		telnet->inflate_more = 0;
+		_free(telnet, telnet->inflate);
+		telnet->inflate = 0;
+		telnet->inflate_alloc = 0;
+	}
+}
+
+/* tear down a stream kept by telnet_reset() (deflate non-zero for the
+ * compression stream), along with the inflate buffer kept with it */
+static void _free_zspare(telnet_t *telnet, int deflate) {
+	if (deflate) {
+		if (telnet->z_out_spare != 0) {
+			deflateEnd(telnet->z_out_spare);
+			_free_zstream(telnet, telnet->z_out_spare);
+			telnet->z_out_spare = 0;
+		}
+	} else if (telnet->z_in_spare != 0) {
+		inflateEnd(telnet->z_in_spare);
+		_free_zstream(telnet, telnet->z_in_spare);
+		telnet->z_in_spare = 0;
+		_free(telnet, telnet->inflate);
+		telnet->inflate = 0;
+		telnet->inflate_alloc = 0;
+	}
+}
+
+/* initialize a zlib box for a telnet box; if deflate is non-zero, it
+ * initializes zlib for delating (compression) of output, otherwise for
+ * inflating (decompression) of input.  the two directions are
+ * independent, as MCCP2 and MCCP3 can both be active.  returns
+ * TELNET_EOK on success, something else on failure.
  */
 telnet_error_t _init_zlib(telnet_t *telnet, int deflate, int err_fatal) {
 	z_stream *z;
 	int rs;
 
 	/* if compression is already enabled, fail loudly */
-	if (telnet->z != 0)
+	if ((deflate ? telnet->z_out : telnet->z_in) != 0)
 		return _error(telnet, __LINE__, __func__, TELNET_EBADVAL,
 				err_fatal, "cannot initialize compression twice");
 
-	/* allocate zstream box */
-	if ((z= (z_stream *)calloc(1, sizeof(z_stream))) == 0)
+	/* a stream kept by telnet_reset() is already reset and ready */
+	if (deflate && telnet->z_out_spare != 0) {
+		telnet->z_out = telnet->z_out_spare;
+		telnet->z_out_spare = 0;
+		return TELNET_EOK;
+	} else if (!deflate && telnet->z_in_spare != 0) {
+		telnet->z_in = telnet->z_in_spare;
+		telnet->z_in_spare = 0;
+		return TELNET_EOK;
+	}
+
+	/* allocate zstream box, from the application's zlib pool if it gave
+	 * us one, or else from the connection's allocator */
+	if (telnet->z_alloc != 0)
+		z = (z_stream *)telnet->z_alloc(telnet->z_opaque, 1,
+				sizeof(z_stream));
+	else
+		z = (z_stream *)_malloc(telnet, sizeof(z_stream));
+	if (z == 0)
 		return _error(telnet, __LINE__, __func__, TELNET_ENOMEM, err_fatal,
 				"malloc() failed: %s", strerror(errno));
+	memset(z, 0, sizeof(z_stream));
+	if (telnet->z_alloc != 0) {
+		z->zalloc = (alloc_func)telnet->z_alloc;
+		z->zfree = (free_func)telnet->z_free;
+		z->opaque = telnet->z_opaque;
+	} else {
+		z->zalloc = _zalloc;
+		z->zfree = _zfree;
+		z->opaque = telnet;
+	}
 
 	/* initialize */
 	if (deflate) {
-		if ((rs = deflateInit(z, Z_DEFAULT_COMPRESSION)) != Z_OK) {
-			free(z);
+		if ((rs = deflateInit2(z, telnet->z_level, Z_DEFLATED,
+				telnet->z_window_bits, telnet->z_mem_level,
+				telnet->z_strategy)) != Z_OK) {
+			_free_zstream(telnet, z);
 			return _error(telnet, __LINE__, __func__, TELNET_ECOMPRESS,
-					err_fatal, "deflateInit() failed: %s", zError(rs));
+					err_fatal, "deflateInit2() failed: %s", zError(rs));
 		}
-		telnet->flags |= TELNET_PFLAG_DEFLATE;
+		telnet->z_out = z;
 	} else {
 		if ((rs = inflateInit(z)) != Z_OK) {
-			free(z);
+			_free_zstream(telnet, z);
 			return _error(telnet, __LINE__, __func__, TELNET_ECOMPRESS,
 					err_fatal, "inflateInit() failed: %s", zError(rs));
 		}
-		telnet->flags &= ~TELNET_PFLAG_DEFLATE;
+		telnet->z_in = z;
 	}
 
-	telnet->z = z;
-
 	return TELNET_EOK;
 }
 #endif /* defined(HAVE_ZLIB) */
 
 /* push bytes out, compressing them first if need be */
-static void _send(telnet_t *telnet, const char *buffer,
-		size_t size) {
+#if defined(HAVE_ZLIB)
+/* compress bytes into the deflate stream and send whatever output zlib
+ * produces; Z_SYNC_FLUSH also pushes out everything pending
+ */
+static void _deflate(telnet_t *telnet, const char *buffer, size_t size,
+		int flush) {
+	char deflate_buffer[1024];
 	telnet_event_t ev;
+	int rs, full;
 
-#if defined(HAVE_ZLIB)
-	/* if we have a deflate (compression) zlib box, use it */
-	if (telnet->z != 0 && telnet->flags & TELNET_PFLAG_DEFLATE) {
-		char deflate_buffer[1024];
-		int rs;
-
-		/* initialize z state */
-		telnet->z->next_in = (unsigned char *)buffer;
-		telnet->z->avail_in = (unsigned int)size;
-		telnet->z->next_out = (unsigned char *)deflate_buffer;
-		telnet->z->avail_out = sizeof(deflate_buffer);
-
-		/* deflate until buffer exhausted and all output is produced */
-		while (telnet->z->avail_in > 0 || telnet->z->avail_out == 0) {
-			/* compress */
-			if ((rs = deflate(telnet->z, Z_SYNC_FLUSH)) != Z_OK) {
-				_error(telnet, __LINE__, __func__, TELNET_ECOMPRESS, 1,
-						"deflate() failed: %s", zError(rs));
-				deflateEnd(telnet->z);
-				free(telnet->z);
-				telnet->z = 0;
-				break;
-			}
+	/* initialize z state */
+	telnet->z_out->next_in = (unsigned char *)buffer;
+	telnet->z_out->avail_in = (unsigned int)size;
+	telnet->stats.deflate_in += size;
+
+	/* deflate until buffer exhausted and all output is produced */
+	do {
+		/* prepare output buffer for this run */
+		telnet->z_out->next_out = (unsigned char *)deflate_buffer;
+		telnet->z_out->avail_out = sizeof(deflate_buffer);
+
+		/* compress; Z_BUF_ERROR only means there was nothing left to do */
+		if ((rs = deflate(telnet->z_out, flush)) == Z_BUF_ERROR)
+			break;
+		if (rs != Z_OK && rs != Z_STREAM_END) {
+			_error(telnet, __LINE__, __func__, TELNET_ECOMPRESS, 1,
+					"deflate() failed: %s", zError(rs));
+			_free_zlib(telnet, 1);
+			return;
+		}
+		full = telnet->z_out->avail_out == 0;
 
-			/* send event */
+		/* send event, if there is anything to send */
+		if (telnet->z_out->avail_out != sizeof(deflate_buffer)) {
 			ev.type = TELNET_EV_SEND;
 			ev.data.buffer = deflate_buffer;
-			ev.data.size = sizeof(deflate_buffer) - telnet->z->avail_out;
-			telnet->eh(telnet, &ev, telnet->ud);
+			ev.data.size = sizeof(deflate_buffer) - telnet->z_out->avail_out;
+			telnet->za_out += ev.data.size;
+			telnet->stats.deflate_out += ev.data.size;
+			telnet->stats.send_bytes += ev.data.size;
+			_event(telnet, &ev);
+		}
+	} while (rs != Z_STREAM_END && (telnet->z_out->avail_in > 0 || full));
+
+	if (flush != Z_NO_FLUSH) {
+		telnet->z_pending = 0;
+		++telnet->za_flushes;
+	}
+}
+
+/* start compressing output with MCCP2 or MCCP3: send the marker
+ * uncompressed, then turn on compression; the caller makes sure no
+ * buffered output is pending
+ */
+static void _start_compress(telnet_t *telnet, unsigned char telopt) {
+	unsigned char marker[5];
+	telnet_event_t ev;
+
+	/* attempt to create output stream first, bail if we can't */
+	if (_init_zlib(telnet, 1, 0) != TELNET_EOK)
+		return;
+	telnet->z_out_telopt = telopt;
+
+	/* send compression marker.  we send directly to the event handler
+	 * instead of passing through _send because _send would result in
+	 * the compress marker itself being compressed.
+	 */
+	marker[0] = TELNET_IAC;
+	marker[1] = TELNET_SB;
+	marker[2] = telopt;
+	marker[3] = TELNET_IAC;
+	marker[4] = TELNET_SE;
+	ev.type = TELNET_EV_SEND;
+	ev.data.buffer = (const char*)marker;
+	ev.data.size = sizeof(marker);
+	telnet->stats.send_bytes += sizeof(marker);
+	_event(telnet, &ev);
+
+	/* start measuring afresh */
+	telnet->za_in = telnet->za_out = 0;
+	telnet->za_flushes = 0;
+	telnet->za_off = 0;
+
+	/* notify app that compression was successfully enabled */
+	ev.type = TELNET_EV_COMPRESS;
+	ev.compress.state = 1;
+	ev.compress.telopt = telopt;
+	_event(telnet, &ev);
+}
+
+/* finish the compressed output stream so the peer sees a clean end of
+ * stream, and go back to sending uncompressed output.  if keep is
+ * non-zero the stream is reset and kept as the spare, so compression
+ * can start again without allocating
+ */
+static void _end_compress(telnet_t *telnet, int keep) {
+	telnet_event_t ev;
+
+	_deflate(telnet, 0, 0, Z_FINISH);
+	if (telnet->z_out == 0)
+		return;
+	if (keep && telnet->z_out_spare == 0 &&
+			deflateReset(telnet->z_out) == Z_OK) {
+		telnet->z_out_spare = telnet->z_out;
+		telnet->z_out = 0;
+		telnet->z_pending = 0;
+	} else
+		_free_zlib(telnet, 1);
+
+	ev.type = TELNET_EV_COMPRESS;
+	ev.compress.state = 0;
+	ev.compress.telopt = telnet->z_out_telopt;
+	_event(telnet, &ev);
+}
+
+/* adaptive compression: once a window of output has been compressed,
+ * end the stream if it did not shrink enough or was flushed in pieces
+ * too small to be worth it
+ */
+static void _adapt_compress(telnet_t *telnet) {
+	/* a proxy passes on its peer's stream and has no say in it */
+	if (telnet->za_in < telnet->za_window || telnet->z_pending != 0 ||
+			telnet->flags & TELNET_FLAG_PROXY)
+		return;
+
+	if (telnet->za_out * telnet->za_ratio > telnet->za_in * 100 ||
+			(telnet->za_flushes != 0 &&
+			telnet->za_in / telnet->za_flushes < telnet->za_flush)) {
+		/* it is likely to be turned back on */
+		_end_compress(telnet, 1);
+		telnet->za_off = 1;
+	}
+
+	telnet->za_in = telnet->za_out = 0;
+	telnet->za_flushes = 0;
+}
+#endif /* defined(HAVE_ZLIB) */
+
+static void _send_raw(telnet_t *telnet, const char *buffer,
+		size_t size) {
+	telnet_event_t ev;
+
+#if defined(HAVE_ZLIB)
+	/* if adaptive compression turned the stream off, bulk output turns
+	 * it back on */
+	if (telnet->za_off && telnet->z_out == 0 &&
+			size >= telnet->za_restart)
+		_start_compress(telnet, telnet->z_out_telopt);
 
-			/* prepare output buffer for next run */
-			telnet->z->next_out = (unsigned char *)deflate_buffer;
-			telnet->z->avail_out = sizeof(deflate_buffer);
+	/* if we have a deflate (compression) zlib box, use it */
+	if (telnet->z_out != 0) {
+		if (size == 0)
+			return;
+		telnet->za_in += size;
+
+		/* by default every write is flushed out on its own; otherwise
+		 * let output build up until the watermark */
+		if (telnet->z_flush == 0) {
+			_deflate(telnet, buffer, size, Z_SYNC_FLUSH);
+		} else {
+			_deflate(telnet, buffer, size, Z_NO_FLUSH);
+			telnet->z_pending += size;
+			if (telnet->z_out != 0 && telnet->z_pending >= telnet->z_flush)
+				_deflate(telnet, 0, 0, Z_SYNC_FLUSH);
 		}
 
+		if (telnet->za_window != 0 && telnet->z_out != 0)
+			_adapt_compress(telnet);
+
 		/* do not continue with remaining code */
 		return;
 	}
@@ -246,7 +837,41 @@ static void _send(telnet_t *telnet, const char *buffer,
 	ev.type = TELNET_EV_SEND;
 	ev.data.buffer = buffer;
 	ev.data.size = size;
-	telnet->eh(telnet, &ev, telnet->ud);
+	telnet->stats.send_bytes += size;
+	_event(telnet, &ev);
+}
+
+/* hand any buffered output on to be compressed and/or sent */
+static INLINE void _send_flush(telnet_t *telnet) {
+	size_t size = telnet->send_pos;
+
+	if (size != 0) {
+		telnet->send_pos = 0;
+		_send_raw(telnet, telnet->send, size);
+	}
+}
+
+/* push bytes out to the socket, or into the output buffer if the
+ * application has asked for output to be buffered
+ */
+static void _send(telnet_t *telnet, const char *buffer,
+		size_t size) {
+	if (telnet->send_size == 0) {
+		_send_raw(telnet, buffer, size);
+		return;
+	}
+
+	/* make room, or send large writes straight through */
+	if (size > telnet->send_size - telnet->send_pos) {
+		_send_flush(telnet);
+		if (size >= telnet->send_size) {
+			_send_raw(telnet, buffer, size);
+			return;
+		}
+	}
+
+	memcpy(telnet->send + telnet->send_pos, buffer, size);
+	telnet->send_pos += size;
 }
 
 /* to send bags of unsigned chars */
@@ -258,95 +883,57 @@ static void _send(telnet_t *telnet, const char *buffer,
  */
 static INLINE int _check_telopt(telnet_t *telnet, unsigned char telopt,
 		int us) {
-	int i;
-
-	/* if we have no telopts table, we obviously don't support it */
-	if (telnet->telopts == 0)
-		return 0;
+	const unsigned char *bits = us ? telnet->telopt_us : telnet->telopt_him;
+	return (bits[telopt >> 3] >> (telopt & 7)) & 1;
+}
 
-	/* loop until found or end marker (us and him both 0) */
-	for (i = 0; telnet->telopts[i].telopt != -1; ++i) {
-		if (telnet->telopts[i].telopt == telopt) {
-			if (us && telnet->telopts[i].us == TELNET_WILL)
-				return 1;
-			else if (!us && telnet->telopts[i].him == TELNET_DO)
-				return 1;
-			else
-				return 0;
-		}
+/* compile a telopt support table into the us/him bitmaps; the first
+ * entry for a telopt wins, as it did when the table was searched
+ */
+static void _compile_telopts(telnet_t *telnet,
+		const telnet_telopt_t *telopts) {
+	unsigned char seen[32];
+	unsigned char bit;
+	int i, index;
+
+	memset(seen, 0, sizeof(seen));
+	for (i = 0; telopts[i].telopt != -1; ++i) {
+		if (telopts[i].telopt < 0 || telopts[i].telopt > 255)
+			continue;
+		index = (unsigned char)telopts[i].telopt >> 3;
+		bit = (unsigned char)(1 << (telopts[i].telopt & 7));
+		if (seen[index] & bit)
+			continue;
+		seen[index] |= bit;
+
+		if (telopts[i].us == TELNET_WILL)
+			telnet->telopt_us[index] |= bit;
+		if (telopts[i].him == TELNET_DO)
+			telnet->telopt_him[index] |= bit;
 	}
-
-	/* not found, so not supported */
-	return 0;
 }
 
 /* retrieve RFC1143 option state */
 static INLINE telnet_rfc1143_t _get_rfc1143(telnet_t *telnet,
 		unsigned char telopt) {
-	telnet_rfc1143_t empty;
-	unsigned int i;
-
-	/* search for entry */
-	for (i = 0; i != telnet->q_cnt; ++i) {
-		if (telnet->q[i].telopt == telopt) {
-			return telnet->q[i];
-		}
-	}
-
-	/* not found, return empty value */
- 	empty.telopt = telopt;
-	empty.state = 0;
-	return empty;
+	telnet_rfc1143_t q;
+	q.telopt = telopt;
+	q.state = telnet->q[telopt];
+	return q;
 }
 
 /* save RFC1143 option state */
 static INLINE void _set_rfc1143(telnet_t *telnet, unsigned char telopt,
 		char us, char him) {
-	telnet_rfc1143_t *qtmp;
-	unsigned int i;
-
-	/* search for entry */
-	for (i = 0; i != telnet->q_cnt; ++i) {
-		if (telnet->q[i].telopt == telopt) {
-			telnet->q[i].state = Q_MAKE(us,him);
-			if (telopt != TELNET_TELOPT_BINARY)
-				return;
-			telnet->flags &= ~(TELNET_FLAG_TRANSMIT_BINARY |
-					   TELNET_FLAG_RECEIVE_BINARY);
-			if (us == Q_YES)
-				telnet->flags |= TELNET_FLAG_TRANSMIT_BINARY;
-			if (him == Q_YES)
-				telnet->flags |= TELNET_FLAG_RECEIVE_BINARY;
-			return;
-		}
-	}
-
-	/* we're going to need to track state for it, so grow the queue
-	 * by 4 (four) elements and put the telopt into it; bail on allocation
-	 * error.  we go by four because it seems like a reasonable guess as
-	 * to the number of enabled options for most simple code, and it
-	 * allows for an acceptable number of reallocations for complex code.
-	 */
-
-    /* Did we reach the end of the table? */
-	if (telnet->q_cnt >= telnet->q_size) {
-		/* Expand the size */
-		if ((qtmp = (telnet_rfc1143_t *)realloc(telnet->q,
-			sizeof(telnet_rfc1143_t) *
-            	(telnet->q_size + Q_BUFFER_GROWTH_QUANTUM))) == 0) {
-			_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
-					"realloc() failed: %s", strerror(errno));
-			return;
-		}
-		memset(&qtmp[telnet->q_size], 0, sizeof(telnet_rfc1143_t) *
-			Q_BUFFER_GROWTH_QUANTUM);
-		telnet->q = qtmp;
-		telnet->q_size += Q_BUFFER_GROWTH_QUANTUM;
-	}
-	/* Add entry to end of table */
-	telnet->q[telnet->q_cnt].telopt = telopt;
-	telnet->q[telnet->q_cnt].state = Q_MAKE(us, him);
-	++telnet->q_cnt;
+	telnet->q[telopt] = (unsigned char)Q_MAKE(us, him);
+	if (telopt != TELNET_TELOPT_BINARY)
+		return;
+	telnet->flags &= ~(TELNET_FLAG_TRANSMIT_BINARY |
+			   TELNET_FLAG_RECEIVE_BINARY);
+	if (us == Q_YES)
+		telnet->flags |= TELNET_FLAG_TRANSMIT_BINARY;
+	if (him == Q_YES)
+		telnet->flags |= TELNET_FLAG_RECEIVE_BINARY;
 }
 
 /* send negotiation bytes */
@@ -386,6 +973,13 @@ static void _negotiate(telnet_t *telnet, unsigned char telopt) {
 	/* lookup the current state of the option */
 	q = _get_rfc1143(telnet, telopt);
 
+	/* a WANT state means this answers a negotiation we started */
+	++telnet->stats.negotiations;
+	if ((telnet->state == TELNET_STATE_WILL ||
+			telnet->state == TELNET_STATE_WONT ? Q_HIM(q) : Q_US(q)) >=
+			Q_WANTNO)
+		++telnet->stats.round_trips;
+
 	/* start processing... */
 	switch ((int)telnet->state) {
 	/* request to enable option on remote end or confirm DO */
@@ -506,28 +1100,64 @@ static void _negotiate(telnet_t *telnet, unsigned char telopt) {
 	}
 }
 
+/* get at least size bytes of scratch space for a subnegotiation parser.
+ * the space is kept by the connection, and only grows when a larger
+ * subnegotiation than any before comes along, so once warmed up the
+ * parsers do not allocate.  the contents are only good until the next
+ * call; returns 0 after raising an error if the space cannot be grown
+ */
+static void *_scratch(telnet_t *telnet, size_t size) {
+	void *scratch;
+
+	if (size <= telnet->scratch_size && telnet->scratch != 0)
+		return telnet->scratch;
+
+	/* grow geometrically, and nothing is worth copying */
+	if (size < telnet->scratch_size * 2)
+		size = telnet->scratch_size * 2;
+	if (size < SCRATCH_SIZE_MIN)
+		size = SCRATCH_SIZE_MIN;
+	if ((scratch = _malloc(telnet, size)) == 0) {
+		_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
+				"malloc() failed: %s", strerror(errno));
+		return 0;
+	}
+	_free(telnet, telnet->scratch);
+	telnet->scratch = scratch;
+	telnet->scratch_size = size;
+	return scratch;
+}
+
 /* process an ENVIRON/NEW-ENVIRON subnegotiation buffer
  *
  * the algorithm and approach used here is kind of a hack,
  * but it reduces the number of memory allocations we have
  * to make.
  *
- * we copy the bytes back into the buffer, starting at the very
- * beginning, which makes it easy to handle the ENVIRON ESC
+ * we copy the bytes into the scratch space, just past the
+ * values array, which makes it easy to handle the ENVIRON ESC
  * escape mechanism as well as ensure the variable name and
  * value strings are NUL-terminated, all while fitting inside
- * of the original buffer.
+ * of the size of the original buffer.  the buffer itself is
+ * left alone, as the subnegotiation event may still need it.
  */
-static int _environ_telnet(telnet_t *telnet, unsigned char type,
-		char* buffer, size_t size) {
+static void _environ_telnet(telnet_t *telnet, unsigned char telopt,
+		const char* buffer, size_t size, void *ctx) {
 	telnet_event_t ev;
 	struct telnet_environ_t *values = 0;
-	char *c, *last, *out;
+	const char *c;
+	char *last, *out;
 	size_t index, count;
 
+	(void)ctx;
+
+	/* no need to parse for an event nobody sees */
+	if (telnet->event_mask & TELNET_EV_MASK(TELNET_EV_ENVIRON))
+		return;
+
 	/* if we have no data, just pass it through */
 	if (size == 0) {
-		return 0;
+		return;
 	}
 
 	/* first byte must be a valid command */
@@ -535,8 +1165,8 @@ static int _environ_telnet(telnet_t *telnet, unsigned char type,
 			(unsigned)buffer[0] != TELNET_ENVIRON_IS &&
 			(unsigned)buffer[0] != TELNET_ENVIRON_INFO) {
 		_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
-				"telopt %d subneg has invalid command", type);
-		return 0;
+				"telopt %d subneg has invalid command", telopt);
+		return;
 	}
 
 	/* store ENVIRON command */
@@ -550,24 +1180,24 @@ static int _environ_telnet(telnet_t *telnet, unsigned char type,
 
 		/* invoke event with our arguments */
 		ev.type = TELNET_EV_ENVIRON;
-		telnet->eh(telnet, &ev, telnet->ud);
+		_event(telnet, &ev);
 
-		return 0;
+		return;
 	}
 
 	/* very second byte must be VAR or USERVAR, if present */
 	if ((unsigned)buffer[1] != TELNET_ENVIRON_VAR &&
 			(unsigned)buffer[1] != TELNET_ENVIRON_USERVAR) {
 		_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
-				"telopt %d subneg missing variable type", type);
-		return 0;
+				"telopt %d subneg missing variable type", telopt);
+		return;
 	}
 
 	/* ensure last byte is not an escape byte (makes parsing later easier) */
 	if ((unsigned)buffer[size - 1] == TELNET_ENVIRON_ESC) {
 		_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
-				"telopt %d subneg ends with ESC", type);
-		return 0;
+				"telopt %d subneg ends with ESC", telopt);
+		return;
 	}
 
 	/* count arguments; each valid entry starts with VAR or USERVAR */
@@ -581,16 +1211,13 @@ static int _environ_telnet(telnet_t *telnet, unsigned char type,
 		}
 	}
 
-	/* allocate argument array, bail on error */
-	if ((values = (struct telnet_environ_t *)calloc(count,
-			sizeof(struct telnet_environ_t))) == 0) {
-		_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
-				"calloc() failed: %s", strerror(errno));
-		return 0;
-	}
+	/* get argument array and room for the strings, bail on error */
+	if ((values = (struct telnet_environ_t *)_scratch(telnet,
+			count * sizeof(struct telnet_environ_t) + size)) == 0)
+		return;
 
 	/* parse argument array strings */
-	out = buffer;
+	out = (char *)(values + count);
 	c = buffer + 1;
 	for (index = 0; index != count; ++index) {
 		/* remember the variable type (will be VAR or USERVAR) */
@@ -652,32 +1279,38 @@ static int _environ_telnet(telnet_t *telnet, unsigned char type,
 
 	/* invoke event with our arguments */
 	ev.type = TELNET_EV_ENVIRON;
-	telnet->eh(telnet, &ev, telnet->ud);
-
-	/* clean up */
-	free(values);
-	return 0;
+	_event(telnet, &ev);
 }
 
-/* process an MSSP subnegotiation buffer */
-static int _mssp_telnet(telnet_t *telnet, char* buffer, size_t size) {
+/* process an MSSP subnegotiation buffer; like ENVIRON, the strings are
+ * copied out into the scratch space */
+static void _mssp_telnet(telnet_t *telnet, unsigned char telopt,
+		const char* buffer, size_t size, void *ctx) {
 	telnet_event_t ev;
 	struct telnet_environ_t *values;
 	char *var = 0;
-	char *c, *last, *out;
+	const char *c;
+	char *last, *out;
 	size_t i, count;
 	unsigned char next_type;
 
+	(void)telopt;
+	(void)ctx;
+
+	/* no need to parse for an event nobody sees */
+	if (telnet->event_mask & TELNET_EV_MASK(TELNET_EV_MSSP))
+		return;
+
 	/* if we have no data, just pass it through */
 	if (size == 0) {
-		return 0;
+		return;
 	}
 
 	/* first byte must be a VAR */
 	if ((unsigned)buffer[0] != TELNET_MSSP_VAR) {
 		_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
 				"MSSP subnegotiation has invalid data");
-		return 0;
+		return;
 	}
 
 	/* count the arguments, any part that starts with VALUE */
@@ -687,19 +1320,15 @@ static int _mssp_telnet(telnet_t *telnet, char* buffer, size_t size) {
 		}
 	}
 
-	/* allocate argument array, bail on error */
-	if ((values = (struct telnet_environ_t *)calloc(count,
-			sizeof(struct telnet_environ_t))) == 0) {
-		_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
-				"calloc() failed: %s", strerror(errno));
-		return 0;
-	}
+	/* get argument array and room for the strings, bail on error */
+	if ((values = (struct telnet_environ_t *)_scratch(telnet,
+			count * sizeof(struct telnet_environ_t) + size)) == 0)
+		return;
 
 	ev.mssp.values = values;
-	ev.mssp.size = count;
 
 	/* allocate strings in argument array */
-	out = last = buffer;
+	out = last = (char *)(values + count);
 	next_type = buffer[0];
 	for (i = 0, c = buffer + 1; c < buffer + size;) {
 		/* search for end marker */
@@ -719,49 +1348,55 @@ static int _mssp_telnet(telnet_t *telnet, char* buffer, size_t size) {
 		} else {
 			_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
 					"invalid MSSP subnegotiation data");
-			free(values);
-			return 0;
+			return;
 		}
 
-		/* remember our next type and increment c for next loop run */
+		/* remember our next type and increment c for next loop run;
+		 * the buffer may end right here, with nothing after it */
 		last = out;
+		if (c == buffer + size)
+			break;
 		next_type = *c++;
 	}
 
+	/* a trailing VAL never fills in its entry, so only report the
+	 * entries we actually stored */
+	ev.mssp.size = i;
+
 	/* invoke event with our arguments */
 	ev.type = TELNET_EV_MSSP;
-	telnet->eh(telnet, &ev, telnet->ud);
-
-	/* clean up */
-	free(values);
-
-	return 0;
+	_event(telnet, &ev);
 }
 
 /* parse ZMP command subnegotiation buffers */
-static int _zmp_telnet(telnet_t *telnet, const char* buffer, size_t size) {
+static void _zmp_telnet(telnet_t *telnet, unsigned char telopt,
+		const char* buffer, size_t size, void *ctx) {
 	telnet_event_t ev;
 	char **argv;
 	const char *c;
 	size_t i, argc;
 
+	(void)telopt;
+	(void)ctx;
+
+	/* no need to parse for an event nobody sees */
+	if (telnet->event_mask & TELNET_EV_MASK(TELNET_EV_ZMP))
+		return;
+
 	/* make sure this is a valid ZMP buffer */
 	if (size == 0 || buffer[size - 1] != 0) {
 		_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
 				"incomplete ZMP frame");
-		return 0;
+		return;
 	}
 
 	/* count arguments */
 	for (argc = 0, c = buffer; c != buffer + size; ++argc)
 		c += strlen(c) + 1;
 
-	/* allocate argument array, bail on error */
-	if ((argv = (char **)calloc(argc, sizeof(char *))) == 0) {
-		_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
-				"calloc() failed: %s", strerror(errno));
-		return 0;
-	}
+	/* get argument array, bail on error */
+	if ((argv = (char **)_scratch(telnet, argc * sizeof(char *))) == 0)
+		return;
 
 	/* populate argument array */
 	for (i = 0, c = buffer; i != argc; ++i) {
@@ -773,22 +1408,26 @@ static int _zmp_telnet(telnet_t *telnet, const char* buffer, size_t size) {
 	ev.type = TELNET_EV_ZMP;
 	ev.zmp.argv = (const char**)argv;
 	ev.zmp.argc = argc;
-	telnet->eh(telnet, &ev, telnet->ud);
-
-	/* clean up */
-	free(argv);
-	return 0;
+	_event(telnet, &ev);
 }
 
 /* parse TERMINAL-TYPE command subnegotiation buffers */
-static int _ttype_telnet(telnet_t *telnet, const char* buffer, size_t size) {
+static void _ttype_telnet(telnet_t *telnet, unsigned char telopt,
+		const char* buffer, size_t size, void *ctx) {
 	telnet_event_t ev;
 
+	(void)telopt;
+	(void)ctx;
+
+	/* no need to parse for an event nobody sees */
+	if (telnet->event_mask & TELNET_EV_MASK(TELNET_EV_TTYPE))
+		return;
+
 	/* make sure request is not empty */
 	if (size == 0) {
 		_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
 				"incomplete TERMINAL-TYPE request");
-		return 0;
+		return;
 	}
 
 	/* make sure request has valid command type */
@@ -796,179 +1435,539 @@ static int _ttype_telnet(telnet_t *telnet, const char* buffer, size_t size) {
 			buffer[0] != TELNET_TTYPE_SEND) {
 		_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
 				"TERMINAL-TYPE request has invalid type");
-		return 0;
+		return;
 	}
 
 	/* send proper event */
 	if (buffer[0] == TELNET_TTYPE_IS) {
 		char *name;
 
-		/* allocate space for name */
-		if ((name = (char *)malloc(size)) == 0) {
-			_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
-					"malloc() failed: %s", strerror(errno));
-			return 0;
-		}
+		/* copy the name out to NUL-terminate it; the buffer may be
+		 * the caller's */
+		if ((name = (char *)_scratch(telnet, size)) == 0)
+			return;
 		memcpy(name, buffer + 1, size - 1);
 		name[size - 1] = '\0';
 
 		ev.type = TELNET_EV_TTYPE;
 		ev.ttype.cmd = TELNET_TTYPE_IS;
 		ev.ttype.name = name;
-		telnet->eh(telnet, &ev, telnet->ud);
-
-		/* clean up */
-		free(name);
+		_event(telnet, &ev);
 	} else {
 		ev.type = TELNET_EV_TTYPE;
 		ev.ttype.cmd = TELNET_TTYPE_SEND;
 		ev.ttype.name = 0;
-		telnet->eh(telnet, &ev, telnet->ud);
+		_event(telnet, &ev);
 	}
 
-	return 0;
 }
 
-/* process a subnegotiation buffer; return non-zero if the current buffer
- * must be aborted and reprocessed due to COMPRESS2 being activated
+#if defined(HAVE_ZLIB)
+/* received COMPRESS2 or COMPRESS3 begin marker, setup our zlib box and
+ * start handling the compressed stream if it's not already.  MCCP2 and
+ * MCCP3 only differ in which side sends the marker.
  */
-static int _subnegotiate(telnet_t *telnet) {
+static void _compress_telnet(telnet_t *telnet, unsigned char telopt,
+		const char* buffer, size_t size, void *ctx) {
 	telnet_event_t ev;
 
-	/* standard subnegotiation event */
-	ev.type = TELNET_EV_SUBNEGOTIATION;
-	ev.sub.telopt = telnet->sb_telopt;
-	ev.sub.buffer = telnet->buffer;
-	ev.sub.size = telnet->buffer_pos;
-	telnet->eh(telnet, &ev, telnet->ud);
+	(void)buffer;
+	(void)size;
+	(void)ctx;
 
-	switch (telnet->sb_telopt) {
-#if defined(HAVE_ZLIB)
-	/* received COMPRESS2 begin marker, setup our zlib box and
-	 * start handling the compressed stream if it's not already.
-	 */
-	case TELNET_TELOPT_COMPRESS2:
-		if (_init_zlib(telnet, 0, 1) != TELNET_EOK)
-			return 0;
+	if (_init_zlib(telnet, 0, 1) != TELNET_EOK)
+		return;
+	telnet->z_in_telopt = telopt;
 
-		/* notify app that compression was enabled */
-		ev.type = TELNET_EV_COMPRESS;
-		ev.compress.state = 1;
-		telnet->eh(telnet, &ev, telnet->ud);
-		return 1;
+	/* notify app that compression was enabled */
+	ev.type = TELNET_EV_COMPRESS;
+	ev.compress.state = 1;
+	ev.compress.telopt = telopt;
+	_event(telnet, &ev);
+}
 #endif /* defined(HAVE_ZLIB) */
 
-	/* specially handled subnegotiation telopt types */
+/* the parser libtelnet has built in for a telopt, if any */
+static telnet_sb_parser_t _sb_builtin(unsigned char telopt) {
+	switch (telopt) {
+#if defined(HAVE_ZLIB)
+	case TELNET_TELOPT_COMPRESS2:
+	case TELNET_TELOPT_COMPRESS3:
+		return _compress_telnet;
+#endif /* defined(HAVE_ZLIB) */
 	case TELNET_TELOPT_ZMP:
-		return _zmp_telnet(telnet, telnet->buffer, telnet->buffer_pos);
+		return _zmp_telnet;
 	case TELNET_TELOPT_TTYPE:
-		return _ttype_telnet(telnet, telnet->buffer, telnet->buffer_pos);
+		return _ttype_telnet;
 	case TELNET_TELOPT_ENVIRON:
 	case TELNET_TELOPT_NEW_ENVIRON:
-		return _environ_telnet(telnet, telnet->sb_telopt, telnet->buffer,
-				telnet->buffer_pos);
+		return _environ_telnet;
 	case TELNET_TELOPT_MSSP:
-		return _mssp_telnet(telnet, telnet->buffer, telnet->buffer_pos);
+		return _mssp_telnet;
 	default:
 		return 0;
 	}
 }
 
+/* process a subnegotiation buffer; return non-zero if the current buffer
+ * must be aborted and reprocessed due to COMPRESS2 being activated.  the
+ * data is either telnet->buffer or a span of the buffer passed to
+ * telnet_recv(); the parsers leave it untouched.
+ */
+static int _subnegotiate(telnet_t *telnet, const char *buffer,
+		size_t size) {
+	telnet_event_t ev;
+	telnet_sb_parser_t parser;
+	void *ctx = 0;
+#if defined(HAVE_ZLIB)
+	int inflating = telnet->z_in != 0;
+#endif /* defined(HAVE_ZLIB) */
+
+	++telnet->stats.sb_count;
+	if (size > telnet->stats.sb_max)
+		telnet->stats.sb_max = size;
+
+	/* find the telopt's parser; until the application registers one,
+	 * the table is the built in parsers */
+	if (telnet->sb_parsers != 0) {
+		parser = telnet->sb_parsers[telnet->sb_telopt].parser;
+		ctx = telnet->sb_parsers[telnet->sb_telopt].ctx;
+	} else
+		parser = _sb_builtin(telnet->sb_telopt);
+
+	/* standard subnegotiation event; when masked it is still raised for
+	 * telopts without a parser, being the only way to see them */
+	telnet->in_sb = 1;
+	if (!telnet->sb_masked || parser == 0) {
+		ev.type = TELNET_EV_SUBNEGOTIATION;
+		ev.sub.telopt = telnet->sb_telopt;
+		ev.sub.buffer = buffer;
+		ev.sub.size = size;
+		_event(telnet, &ev);
+	}
+
+	/* hand the data to the parser */
+	if (parser != 0)
+		parser(telnet, telnet->sb_telopt, buffer, size, ctx);
+	telnet->in_sb = 0;
+
+#if defined(HAVE_ZLIB)
+	/* if the parser started decompression, the rest of the input is
+	 * compressed */
+	return !inflating && telnet->z_in != 0;
+#else
+	return 0;
+#endif /* defined(HAVE_ZLIB) */
+}
+
 /* initialize a telnet state tracker */
 telnet_t *telnet_init(const telnet_telopt_t *telopts,
 		telnet_event_handler_t eh, unsigned char flags, void *user_data) {
-	/* allocate structure */
-	struct telnet_t *telnet = (telnet_t*)calloc(1, sizeof(telnet_t));
-	if (telnet == 0)
+	return telnet_init_ex(telopts, eh, flags, user_data, 0);
+}
+
+/* check an application allocator, substituting the C library's for 0;
+ * returns 0 if it lacks a required hook
+ */
+static const telnet_allocator_t *_check_allocator(
+		const telnet_allocator_t *allocator) {
+	static const telnet_allocator_t libc_allocator = {
+		_libc_malloc, _libc_realloc, _libc_free, 0
+	};
+
+	if (allocator == 0)
+		return &libc_allocator;
+	if (allocator->malloc_hook == 0 || allocator->free_hook == 0)
 		return 0;
+	return allocator;
+}
 
-	/* initialize data */
+/* fill in a freshly zeroed state tracker */
+static void _init(telnet_t *telnet, const telnet_telopt_t *telopts,
+		telnet_event_handler_t eh, unsigned char flags, void *user_data,
+		const telnet_allocator_t *allocator) {
+	telnet->allocator = *allocator;
 	telnet->ud = user_data;
-	telnet->telopts = telopts;
+	if (telopts != 0)
+		_compile_telopts(telnet, telopts);
 	telnet->eh = eh;
 	telnet->flags = flags;
+	telnet->buffer_initial = SB_BUFFER_INITIAL;
+	telnet->buffer_growth = SB_BUFFER_GROWTH;
+	telnet->buffer_max = SB_BUFFER_MAX;
+#if defined(HAVE_ZLIB)
+	telnet->z_level = Z_DEFAULT_COMPRESSION;
+	telnet->z_window_bits = MAX_WBITS;
+	telnet->z_mem_level = 8; /* deflateInit()'s default */
+	telnet->z_strategy = Z_DEFAULT_STRATEGY;
+	telnet->inflate_size = INFLATE_BUFFER_SIZE;
+#endif /* defined(HAVE_ZLIB) */
+}
+
+/* initialize a telnet state tracker whose memory comes from allocator */
+telnet_t *telnet_init_ex(const telnet_telopt_t *telopts,
+		telnet_event_handler_t eh, unsigned char flags, void *user_data,
+		const telnet_allocator_t *allocator) {
+	struct telnet_t *telnet;
+
+	if ((allocator = _check_allocator(allocator)) == 0)
+		return 0;
 
+	/* allocate structure */
+	telnet = (telnet_t *)allocator->malloc_hook(allocator->ctx,
+			sizeof(telnet_t));
+	if (telnet == 0)
+		return 0;
+	memset(telnet, 0, sizeof(telnet_t));
+
+	_init(telnet, telopts, eh, flags, user_data, allocator);
 	return telnet;
 }
 
+/* size of the memory telnet_init_inplace() needs */
+size_t telnet_sizeof(void) {
+	return sizeof(telnet_t);
+}
+
+/* initialize a telnet state tracker in memory the application owns */
+telnet_t *telnet_init_inplace(void *mem, const telnet_telopt_t *telopts,
+		telnet_event_handler_t eh, unsigned char flags, void *user_data,
+		const telnet_allocator_t *allocator) {
+	telnet_t *telnet = (telnet_t *)mem;
+
+	if (mem == 0 || (allocator = _check_allocator(allocator)) == 0)
+		return 0;
+
+	memset(telnet, 0, sizeof(telnet_t));
+	_init(telnet, telopts, eh, flags, user_data, allocator);
+	telnet->inplace = 1;
+	return telnet;
+}
+
+/* return a state tracker to its initial state for a new connection,
+ * keeping its settings and the memory it has allocated
+ */
+void telnet_reset(telnet_t *telnet) {
+#if defined(HAVE_ZLIB)
+	/* active streams are reset and kept for the next connection, unless
+	 * a spare is kept already */
+	if (telnet->z_out != 0) {
+		if (telnet->z_out_spare == 0 && deflateReset(telnet->z_out) ==
+				Z_OK) {
+			telnet->z_out_spare = telnet->z_out;
+			telnet->z_out = 0;
+		} else
+			_free_zlib(telnet, 1);
+	}
+	if (telnet->z_in != 0) {
+		if (telnet->z_in_spare == 0 && inflateReset(telnet->z_in) ==
+				Z_OK) {
+			telnet->z_in_spare = telnet->z_in;
+			telnet->z_in = 0;
+		} else
+			_free_zlib(telnet, 0);
+	}
+	telnet->z_out_telopt = 0;
+	telnet->z_in_telopt = 0;
+	telnet->z_in_end = 0;
+	telnet->inflate_pos = 0;
+	telnet->inflate_end = 0;
+	telnet->inflate_held = 0;
+	telnet->inflate_more = 0;
+	telnet->z_pending = 0;
+	telnet->za_in = 0;
+	telnet->za_out = 0;
+	telnet->za_flushes = 0;
+	telnet->za_off = 0;
+#endif /* defined(HAVE_ZLIB) */
+
+	/* protocol state; pending input and output are discarded */
+	telnet->state = TELNET_STATE_DATA;
+	telnet->flags &= ~(TELNET_FLAG_TRANSMIT_BINARY |
+			TELNET_FLAG_RECEIVE_BINARY);
+	telnet->sb_telopt = 0;
+	telnet->buffer_pos = 0;
+	telnet->buffer_small = 0;
+	telnet->data_pos = 0;
+	telnet->send_pos = 0;
+	telnet->feed = 0;
+	telnet->feed_size = 0;
+	telnet->stop = 0;
+	telnet->paused = 0;
+	if (telnet->pull != 0) {
+		telnet->pull->count = 0;
+		telnet->pull->next = 0;
+	}
+	memset(telnet->q, 0, sizeof(telnet->q));
+	memset(&telnet->stats, 0, sizeof(telnet->stats));
+}
+
 /* free up any memory allocated by a state tracker */
 void telnet_free(telnet_t *telnet) {
 	/* free sub-request buffer */
 	if (telnet->buffer != 0) {
-		free(telnet->buffer);
+		_free(telnet, telnet->buffer);
 		telnet->buffer = 0;
 		telnet->buffer_size = 0;
 		telnet->buffer_pos = 0;
 	}
 
+	/* free data coalescing buffer if we own it */
+	if (telnet->data_owned)
+		_free(telnet, telnet->data);
+
+	/* free output buffers; anything not flushed is discarded */
+	_free(telnet, telnet->send);
+	_free(telnet, telnet->fmt);
+	_free(telnet, telnet->scratch);
+	_free(telnet, telnet->pull);
+	_free(telnet, telnet->sb_parsers);
+
 #if defined(HAVE_ZLIB)
-	/* free zlib box */
-	if (telnet->z != 0) {
-		if (telnet->flags & TELNET_PFLAG_DEFLATE)
-			deflateEnd(telnet->z);
-		else
-			inflateEnd(telnet->z);
-		free(telnet->z);
-		telnet->z = 0;
-	}
+	/* free zlib boxes */
+	if (telnet->z_out != 0)
+		_free_zlib(telnet, 1);
+	if (telnet->z_in != 0)
+		_free_zlib(telnet, 0);
+	_free_zspare(telnet, 1);
+	_free_zspare(telnet, 0);
 #endif /* defined(HAVE_ZLIB) */
 
-	/* free RFC1143 queue */
-	if (telnet->q) {
-		free(telnet->q);
-		telnet->q = NULL;
-		telnet->q_size = 0;
-		telnet->q_cnt = 0;
+	/* free the telnet structure itself, unless the application owns
+	 * it */
+	if (!telnet->inplace)
+		_free(telnet, telnet);
+}
+
+/* called as a new subnegotiation begins; gives back an oversized buffer
+ * once enough consecutive small subnegotiations have gone by
+ */
+static void _buffer_reclaim(telnet_t *telnet) {
+	char *new_buffer;
+
+	if (telnet->buffer_shrink == 0 ||
+			telnet->buffer_size <= telnet->buffer_initial)
+		return;
+
+	/* a large subnegotiation restarts the count */
+	if (telnet->buffer_pos > telnet->buffer_initial) {
+		telnet->buffer_small = 0;
+		return;
 	}
 
-	/* free the telnet structure itself */
-	free(telnet);
+	if (++telnet->buffer_small < telnet->buffer_shrink)
+		return;
+
+	/* if shrinking fails we simply keep the larger buffer */
+	new_buffer = (char *)_realloc(telnet, telnet->buffer,
+			telnet->buffer_pos, telnet->buffer_initial);
+	if (new_buffer != 0) {
+		telnet->buffer = new_buffer;
+		telnet->buffer_size = telnet->buffer_initial;
+	}
+	telnet->buffer_small = 0;
 }
 
-/* push a byte into the telnet buffer */
-static telnet_error_t _buffer_byte(telnet_t *telnet,
-		unsigned char byte) {
+/* push bytes into the telnet buffer, growing it as needed; returns the
+ * number of bytes buffered, which falls short of size if the buffer
+ * could not grow far enough
+ */
+static size_t _buffer_bytes(telnet_t *telnet, const char *bytes,
+		size_t size) {
 	char *new_buffer;
-	size_t i;
+	size_t i, len, done;
+
+	for (done = 0; done != size; done += len) {
+		/* check if we're out of room */
+		if (telnet->buffer_pos == telnet->buffer_size) {
+			/* overflow -- can't grow any more */
+			if (telnet->buffer_size >= telnet->buffer_max) {
+				++telnet->stats.sb_overflows;
+				_error(telnet, __LINE__, __func__, TELNET_EOVERFLOW, 0,
+						"subnegotiation buffer size limit reached");
+				return done;
+			}
 
-	/* check if we're out of room */
-	if (telnet->buffer_pos == telnet->buffer_size) {
-		/* find the next buffer size */
-		for (i = 0; i != _buffer_sizes_count; ++i) {
-			if (_buffer_sizes[i] == telnet->buffer_size) {
-				break;
+			/* find the next buffer size */
+			if (telnet->buffer_size == 0)
+				i = telnet->buffer_initial;
+			else if (telnet->buffer_growth < 2 || telnet->buffer_size >
+					telnet->buffer_max / telnet->buffer_growth)
+				i = telnet->buffer_max;
+			else
+				i = telnet->buffer_size * telnet->buffer_growth;
+			if (i > telnet->buffer_max)
+				i = telnet->buffer_max;
+
+			/* (re)allocate buffer */
+			new_buffer = (char *)_realloc(telnet, telnet->buffer,
+					telnet->buffer_pos, i);
+			if (new_buffer == 0) {
+				_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
+						"realloc() failed");
+				return done;
 			}
+
+			telnet->buffer = new_buffer;
+			telnet->buffer_size = i;
 		}
 
-		/* overflow -- can't grow any more */
-		if (i >= _buffer_sizes_count - 1) {
-			_error(telnet, __LINE__, __func__, TELNET_EOVERFLOW, 0,
-					"subnegotiation buffer size limit reached");
-			return TELNET_EOVERFLOW;
+		/* copy as much as fits */
+		len = telnet->buffer_size - telnet->buffer_pos;
+		if (len > size - done)
+			len = size - done;
+		memcpy(telnet->buffer + telnet->buffer_pos, bytes + done, len);
+		telnet->buffer_pos += len;
+	}
+
+	return done;
+}
+
+/* send a data event for a chunk of received data */
+static INLINE void _data_event(telnet_t *telnet, const char *buffer,
+		size_t size) {
+	telnet_event_t ev;
+	ev.type = TELNET_EV_DATA;
+	ev.data.buffer = buffer;
+	ev.data.size = size;
+	_event(telnet, &ev);
+}
+
+/* add received data that does not fit in what is left of the data
+ * buffer, passing the buffer on each time it fills up
+ */
+static void _data_overflow(telnet_t *telnet, const char *buffer,
+		size_t size) {
+	size_t len;
+
+	/* an event being pulled keeps the buffer until parsing resumes, so
+	 * pass on what it holds, then the new bytes where they lie */
+	if (telnet->pulling) {
+		if (telnet->data_pos != 0) {
+			_data_event(telnet, telnet->data, telnet->data_pos);
+			telnet->data_pos = 0;
 		}
+		_data_event(telnet, buffer, size);
+		return;
+	}
 
-		/* (re)allocate buffer */
-		new_buffer = (char *)realloc(telnet->buffer, _buffer_sizes[i + 1]);
-		if (new_buffer == 0) {
-			_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
-					"realloc() failed");
-			return TELNET_ENOMEM;
+	while (size != 0) {
+		len = telnet->data_size - telnet->data_pos;
+		if (len > size)
+			len = size;
+		memcpy(telnet->data + telnet->data_pos, buffer, len);
+		telnet->data_pos += len;
+		buffer += len;
+		size -= len;
+
+		/* buffer is full, pass it on and start over */
+		if (telnet->data_pos == telnet->data_size) {
+			_data_event(telnet, telnet->data, telnet->data_pos);
+			telnet->data_pos = 0;
 		}
+	}
+}
 
-		telnet->buffer = new_buffer;
-		telnet->buffer_size = _buffer_sizes[i + 1];
+/* add received data to the current run; when coalescing, the bytes are
+ * copied into the data buffer, otherwise they are passed on right away
+ */
+static INLINE void _data_append(telnet_t *telnet, const char *buffer,
+		size_t size) {
+	if (telnet->data_size == 0) {
+		if (size != 0)
+			_data_event(telnet, buffer, size);
+		return;
 	}
 
-	/* push the byte, all set */
-	telnet->buffer[telnet->buffer_pos++] = byte;
-	return TELNET_EOK;
+	/* common case: the bytes fit with room to spare */
+	if (size < telnet->data_size - telnet->data_pos) {
+		memcpy(telnet->data + telnet->data_pos, buffer, size);
+		telnet->data_pos += size;
+		return;
+	}
+
+	_data_overflow(telnet, buffer, size);
+}
+
+/* finish the current run of received data, ending with the given bytes;
+ * if nothing had to be unescaped they are passed on without a copy
+ */
+static void _data_flush(telnet_t *telnet, const char *buffer,
+		size_t size) {
+	if (telnet->data_pos != 0) {
+		if (size != 0)
+			_data_append(telnet, buffer, size);
+		if (telnet->data_pos != 0) {
+			_data_event(telnet, telnet->data, telnet->data_pos);
+			telnet->data_pos = 0;
+		}
+	} else if (size != 0)
+		_data_event(telnet, buffer, size);
 }
 
-static void _process(telnet_t *telnet, const char *buffer, size_t size) {
+/* parse bytes up to the end of the buffer, or until compression begins
+ * or, if stoppable, the parser is asked to stop; returns the number of
+ * bytes parsed.  stoppable is a constant at each call site so
+ * telnet_recv() does not pay for the check on every byte
+ */
+static FORCE_INLINE size_t _process(telnet_t *telnet, const char *buffer,
+		size_t size, int stoppable) {
+	static const char cr = '\r';
+	static const char iac = (char)TELNET_IAC;
 	telnet_event_t ev;
 	unsigned char byte;
-	size_t i, start;
-	for (i = start = 0; i != size; ++i) {
+	const char *sb;
+	size_t i, start, len, n;
+	for (i = start = 0; i != size && !(stoppable && telnet->stop); ++i) {
+		/* plain data needs no per-byte work; skip straight to the next
+		 * IAC, or CR if NVT EOL translation is active */
+		if (telnet->state == TELNET_STATE_DATA) {
+			byte = (telnet->flags & TELNET_FLAG_NVT_EOL) &&
+					!(telnet->flags & TELNET_FLAG_RECEIVE_BINARY) ?
+					'\r' : TELNET_IAC;
+			i += _scan(buffer + i, size - i, TELNET_IAC, byte, byte);
+			if (i == size)
+				break;
+
+		/* the same goes for subnegotiation data, up to the next IAC (or
+		 * the WILL of an MCCPv1 start sequence, see below) */
+		} else if (telnet->state == TELNET_STATE_SB_DATA) {
+			byte = telnet->sb_telopt == TELNET_TELOPT_COMPRESS ?
+					TELNET_WILL : TELNET_IAC;
+			len = _scan(buffer + i, size - i, TELNET_IAC, byte, byte);
+
+			/* if the whole subnegotiation is in this buffer and has no
+			 * escaped bytes, parse it where it lies instead of copying
+			 * it into our own buffer */
+			if (telnet->buffer_pos == 0 && i + len + 1 < size &&
+					(unsigned char)buffer[i + len] == TELNET_IAC &&
+					(unsigned char)buffer[i + len + 1] == TELNET_SE &&
+					len <= telnet->buffer_max) {
+				sb = buffer + i;
+				i += len + 1;
+				start = i + 1;
+				telnet->state = TELNET_STATE_DATA;
+
+				/* see the comment in TELNET_STATE_SB_DATA_IAC about
+				 * stopping */
+				if (_subnegotiate(telnet, sb, len) != 0)
+					size = i + 1;
+				continue;
+			}
+
+			/* buffer the run, or bail if we can't; the byte that did
+			 * not fit is dropped */
+			n = _buffer_bytes(telnet, buffer + i, len);
+			i += n;
+			if (n != len) {
+				start = i + 1;
+				telnet->state = TELNET_STATE_DATA;
+				continue;
+			}
+			if (i == size)
+				break;
+		}
+
 		byte = buffer[i];
 		switch (telnet->state) {
 		/* regular data */
@@ -976,36 +1975,30 @@ static void _process(telnet_t *telnet, const char *buffer, size_t size) {
 			/* on an IAC byte, pass through all pending bytes and
 			 * switch states */
 			if (byte == TELNET_IAC) {
-				if (i != start) {
-					ev.type = TELNET_EV_DATA;
-					ev.data.buffer = buffer + start;
-					ev.data.size = i - start;
-					telnet->eh(telnet, &ev, telnet->ud);
+				/* when coalescing, an escaped IAC that is complete in
+				 * this buffer simply becomes part of the current run */
+				if (telnet->data_size != 0 && i + 1 != size &&
+						(unsigned char)buffer[i + 1] == TELNET_IAC) {
+					++telnet->stats.iac_recv;
+					_data_append(telnet, buffer + start, i + 1 - start);
+					start = i + 2;
+					++i;
+					break;
 				}
+				_data_flush(telnet, buffer + start, i - start);
 				telnet->state = TELNET_STATE_IAC;
 			} else if (byte == '\r' &&
 					   (telnet->flags & TELNET_FLAG_NVT_EOL) &&
 					   !(telnet->flags & TELNET_FLAG_RECEIVE_BINARY)) {
-				if (i != start) {
-					ev.type = TELNET_EV_DATA;
-					ev.data.buffer = buffer + start;
-					ev.data.size = i - start;
-					telnet->eh(telnet, &ev, telnet->ud);
-				}
+				_data_append(telnet, buffer + start, i - start);
 				telnet->state = TELNET_STATE_EOL;
 			}
 			break;
 
 		/* NVT EOL to be translated */
 		case TELNET_STATE_EOL:
-			if (byte != '\n') {
-				byte = '\r';
-				ev.type = TELNET_EV_DATA;
-				ev.data.buffer = (char*)&byte;
-				ev.data.size = 1;
-				telnet->eh(telnet, &ev, telnet->ud);
-				byte = buffer[i];
-			}
+			if (byte != '\n')
+				_data_append(telnet, &cr, 1);
 			/* any byte following '\r' other than '\n' or '\0' is invalid,
 			 * so pass both \r and the byte */
 			start = i;
@@ -1017,6 +2010,10 @@ static void _process(telnet_t *telnet, const char *buffer, size_t size) {
 
 		/* IAC command */
 		case TELNET_STATE_IAC:
+			/* anything but an escaped IAC ends the current run of data */
+			if (byte != TELNET_IAC)
+				_data_flush(telnet, 0, 0);
+
 			switch (byte) {
 			/* subnegotiation */
 			case TELNET_SB:
@@ -1038,10 +2035,8 @@ static void _process(telnet_t *telnet, const char *buffer, size_t size) {
 			/* IAC escaping */
 			case TELNET_IAC:
 				/* event */
-				ev.type = TELNET_EV_DATA;
-				ev.data.buffer = (char*)&byte;
-				ev.data.size = 1;
-				telnet->eh(telnet, &ev, telnet->ud);
+				++telnet->stats.iac_recv;
+				_data_append(telnet, &iac, 1);
 
 				/* state update */
 				start = i + 1;
@@ -1052,7 +2047,7 @@ static void _process(telnet_t *telnet, const char *buffer, size_t size) {
 				/* event */
 				ev.type = TELNET_EV_IAC;
 				ev.iac.cmd = byte;
-				telnet->eh(telnet, &ev, telnet->ud);
+				_event(telnet, &ev);
 
 				/* state update */
 				start = i + 1;
@@ -1072,27 +2067,27 @@ static void _process(telnet_t *telnet, const char *buffer, size_t size) {
 
 		/* subnegotiation -- determine subnegotiation telopt */
 		case TELNET_STATE_SB:
+			_buffer_reclaim(telnet);
 			telnet->sb_telopt = byte;
 			telnet->buffer_pos = 0;
 			telnet->state = TELNET_STATE_SB_DATA;
 			break;
 
-		/* subnegotiation -- buffer bytes until end request */
+		/* subnegotiation -- the data itself was buffered above, so this
+		 * is the byte that ended the run */
 		case TELNET_STATE_SB_DATA:
 			/* IAC command in subnegotiation -- either IAC SE or IAC IAC */
 			if (byte == TELNET_IAC) {
 				telnet->state = TELNET_STATE_SB_DATA_IAC;
-			} else if (telnet->sb_telopt == TELNET_TELOPT_COMPRESS && byte == TELNET_WILL) {
+			} else {
 				/* In 1998 MCCP used TELOPT 85 and the protocol defined an invalid
 				 * subnegotiation sequence (IAC SB 85 WILL SE) to start compression.
 				 * Subsequently MCCP version 2 was created in 2000 using TELOPT 86
 				 * and a valid subnegotiation (IAC SB 86 IAC SE). libtelnet for now
 				 * just captures and discards MCCPv1 sequences.
 				 */
-				start = i + 2;
-				telnet->state = TELNET_STATE_DATA;
-			/* buffer the byte, or bail if we can't */
-			} else if (_buffer_byte(telnet, byte) != TELNET_EOK) {
+				if (i + 1 != size)
+					++i;
 				start = i + 1;
 				telnet->state = TELNET_STATE_DATA;
 			}
@@ -1108,22 +2103,20 @@ static void _process(telnet_t *telnet, const char *buffer, size_t size) {
 				telnet->state = TELNET_STATE_DATA;
 
 				/* process subnegotiation */
-				if (_subnegotiate(telnet) != 0) {
+				if (_subnegotiate(telnet, telnet->buffer,
+						telnet->buffer_pos) != 0) {
 					/* any remaining bytes in the buffer are compressed.
-					 * we have to re-invoke telnet_recv to get those
-					 * bytes inflated and abort trying to process the
-					 * remaining compressed bytes in the current _process
-					 * buffer argument
+					 * stop here, so _recv() gets those bytes inflated
+					 * instead of us processing them as they are
 					 */
-					telnet_recv(telnet, &buffer[start], size - start);
-					return;
+					size = i + 1;
 				}
 				break;
 			/* escaped IAC byte */
 			case TELNET_IAC:
+				++telnet->stats.iac_recv;
 				/* push IAC into buffer */
-				if (_buffer_byte(telnet, TELNET_IAC) !=
-						TELNET_EOK) {
+				if (_buffer_bytes(telnet, (const char *)&byte, 1) != 1) {
 					start = i + 1;
 					telnet->state = TELNET_STATE_DATA;
 				} else {
@@ -1144,17 +2137,18 @@ static void _process(telnet_t *telnet, const char *buffer, size_t size) {
 				telnet->state = TELNET_STATE_IAC;
 
 				/* process subnegotiation; see comment in
-				 * TELNET_STATE_SB_DATA_IAC about invoking telnet_recv()
+				 * TELNET_STATE_SB_DATA_IAC about stopping
 				 */
-				if (_subnegotiate(telnet) != 0) {
-					telnet_recv(telnet, &buffer[start], size - start);
-					return;
+				if (_subnegotiate(telnet, telnet->buffer,
+						telnet->buffer_pos) != 0) {
+					size = i + 1;
 				} else {
-					/* recursive call to get the current input byte processed
-					 * as a regular IAC command.  we could use a goto, but
-					 * that would be gross.
+					/* step back so the current input byte is processed
+					 * again, now in the IAC state, as a regular IAC
+					 * command; if the parser stops first, it is where
+					 * parsing picks up again
 					 */
-					_process(telnet, (char *)&byte, 1);
+					start = i--;
 				}
 				break;
 			}
@@ -1163,70 +2157,556 @@ static void _process(telnet_t *telnet, const char *buffer, size_t size) {
 	}
 
 	/* pass through any remaining bytes */
-	if (telnet->state == TELNET_STATE_DATA && i != start) {
-		ev.type = TELNET_EV_DATA;
-		ev.data.buffer = buffer + start;
-		ev.data.size = i - start;
-		telnet->eh(telnet, &ev, telnet->ud);
+	if (telnet->state == TELNET_STATE_DATA)
+		_data_flush(telnet, buffer + start, i - start);
+	else
+		_data_flush(telnet, 0, 0);
+
+	return i;
+}
+
+/* run the parser specialized for whether it may be stopped */
+static size_t _parse(telnet_t *telnet, const char *buffer, size_t size,
+		int stoppable) {
+	if (stoppable)
+		return _process(telnet, buffer, size, 1);
+	return _process(telnet, buffer, size, 0);
+}
+
+#if defined(HAVE_ZLIB)
+/* inflate as much of the buffer as fits in the inflate buffer, leaving
+ * the output there to be parsed; returns the number of bytes consumed
+ */
+static size_t _inflate(telnet_t *telnet, const char *buffer, size_t size) {
+	int rs;
+
+	/* the inflate buffer is allocated when first needed, and resized
+	 * here so it never changes while in use */
+	if (telnet->inflate_alloc != telnet->inflate_size) {
+		_free(telnet, telnet->inflate);
+		if ((telnet->inflate = (char *)_malloc(telnet,
+				telnet->inflate_size)) == 0) {
+			telnet->inflate_alloc = 0;
+			_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 1,
+					"malloc() failed: %s", strerror(errno));
+			return size;
+		}
+		telnet->inflate_alloc = telnet->inflate_size;
 	}
+
+	/* prepare zlib state and output buffer for this run */
+	telnet->z_in->next_in = (unsigned char *)buffer;
+	telnet->z_in->avail_in = (unsigned int)size;
+	telnet->z_in->next_out = (unsigned char *)telnet->inflate;
+	telnet->z_in->avail_out = (unsigned int)telnet->inflate_alloc;
+
+	/* decompress; Z_BUF_ERROR only means zlib needs more input */
+	rs = inflate(telnet->z_in, Z_SYNC_FLUSH);
+	telnet->stats.inflate_in += size - telnet->z_in->avail_in;
+	telnet->inflate_more = telnet->z_in->avail_out == 0;
+	if (rs == Z_BUF_ERROR) {
+		telnet->inflate_more = 0;
+		return size;
+	}
+
+	/* the decompressed bytes are parsed on success */
+	if (rs == Z_OK || rs == Z_STREAM_END) {
+		telnet->inflate_pos = 0;
+		telnet->inflate_end = telnet->inflate_alloc -
+				telnet->z_in->avail_out;
+		telnet->stats.inflate_out += telnet->inflate_end;
+	} else
+		_error(telnet, __LINE__, __func__, TELNET_ECOMPRESS, 1,
+				"inflate() failed: %s", zError(rs));
+
+	/* on error (or on end of stream) disable further inflation once the
+	 * output is parsed; on error the rest of the input is dropped, and
+	 * anything after the end of the stream is uncompressed */
+	if (rs != Z_OK) {
+		telnet->z_in_end = 1;
+		if (rs != Z_STREAM_END)
+			return size;
+	}
+
+	return size - telnet->z_in->avail_in;
+}
+
+/* tear down the input stream once it has ended */
+static void _end_inflate(telnet_t *telnet) {
+	telnet_event_t ev;
+
+	/* disable compression */
+	_free_zlib(telnet, 0);
+
+	/* send event */
+	ev.type = TELNET_EV_COMPRESS;
+	ev.compress.state = 0;
+	ev.compress.telopt = telnet->z_in_telopt;
+	_event(telnet, &ev);
+}
+#endif /* defined(HAVE_ZLIB) */
+
+/* parse bytes, inflating them first if input is compressed, until they
+ * run out or, if stoppable, the event handler paused or, when pulling,
+ * an event is waiting; returns the number of bytes consumed.
+ * decompressed bytes left over are kept for next time, and when
+ * stopping with some left, the compressed bytes they came from are not
+ * counted as consumed, so the caller passes them in again
+ */
+static size_t _recv(telnet_t *telnet, const char *buffer, size_t size,
+		int stoppable) {
+	size_t done = 0;
+#if defined(HAVE_ZLIB)
+	size_t last = 0, n;
+#endif /* defined(HAVE_ZLIB) */
+
+	telnet->paused = 0;
+	while (!(stoppable && telnet->paused) &&
+			(!telnet->pulling || telnet->pull->count == 0)) {
+		telnet->stop = 0;
+#if defined(HAVE_ZLIB)
+		/* decompressed bytes come first, then the end of their stream */
+		if (telnet->inflate_pos != telnet->inflate_end) {
+			telnet->inflate_pos += _parse(telnet,
+					telnet->inflate + telnet->inflate_pos,
+					telnet->inflate_end - telnet->inflate_pos, stoppable);
+			continue;
+		}
+		if (telnet->z_in_end) {
+			_end_inflate(telnet);
+			continue;
+		}
+
+		/* skip input held back last time, which zlib already has, once
+		 * all of its output is parsed */
+		if (telnet->inflate_held != 0 && !telnet->inflate_more) {
+			if (done == size)
+				break;
+			n = size - done < telnet->inflate_held ?
+					size - done : telnet->inflate_held;
+			telnet->inflate_held -= n;
+			done += n;
+			continue;
+		}
+
+		/* if we have an inflate (decompression) zlib stream, use it,
+		 * until the input is exhausted and all output is produced;
+		 * input that is held back is not given again */
+		if (telnet->z_in != 0) {
+			if (done == size && !telnet->inflate_more)
+				break;
+			if (!telnet->inflate_more)
+				last = 0;
+			n = _inflate(telnet, buffer + done,
+					telnet->inflate_held != 0 ? 0 : size - done);
+			last += n;
+			done += n;
+			continue;
+		}
+#endif /* defined(HAVE_ZLIB) */
+
+		/* input compression is not active, just process; this stops
+		 * early if compression begins */
+		if (done == size)
+			break;
+		done += _parse(telnet, buffer + done, size - done, stoppable);
+	}
+
+#if defined(HAVE_ZLIB)
+	/* stopped before the output of the last compressed bytes was
+	 * parsed; hold them back until it is */
+	if (telnet->inflate_pos != telnet->inflate_end ||
+			telnet->inflate_more || telnet->z_in_end) {
+		done -= last;
+		telnet->inflate_held += last;
+	}
+#endif /* defined(HAVE_ZLIB) */
+
+	return done;
 }
 
 /* push a bytes into the state tracker */
 void telnet_recv(telnet_t *telnet, const char *buffer,
 		size_t size) {
-#if defined(HAVE_ZLIB)
-	/* if we have an inflate (decompression) zlib stream, use it */
-	if (telnet->z != 0 && !(telnet->flags & TELNET_PFLAG_DEFLATE)) {
-		char inflate_buffer[1024];
-		int rs;
-
-		/* initialize zlib state */
-		telnet->z->next_in = (unsigned char*)buffer;
-		telnet->z->avail_in = (unsigned int)size;
-		telnet->z->next_out = (unsigned char *)inflate_buffer;
-		telnet->z->avail_out = sizeof(inflate_buffer);
-
-		/* inflate until buffer exhausted and all output is produced */
-		while (telnet->z->avail_in > 0 || telnet->z->avail_out == 0) {
-			/* reset output buffer */
-
-			/* decompress */
-			rs = inflate(telnet->z, Z_SYNC_FLUSH);
-
-			/* process the decompressed bytes on success */
-			if (rs == Z_OK || rs == Z_STREAM_END)
-				_process(telnet, inflate_buffer, sizeof(inflate_buffer) -
-						telnet->z->avail_out);
-			else
-				_error(telnet, __LINE__, __func__, TELNET_ECOMPRESS, 1,
-						"inflate() failed: %s", zError(rs));
+	telnet->stats.recv_bytes += size;
+	_recv(telnet, buffer, size, 0);
+}
+
+/* push bytes into the state tracker until the event handler pauses */
+size_t telnet_recv_partial(telnet_t *telnet, const char *buffer,
+		size_t size) {
+	size_t done = _recv(telnet, buffer, size, 1);
+	telnet->stats.recv_bytes += done;
+	return done;
+}
+
+/* have telnet_recv_partial() return after the current byte */
+void telnet_pause(telnet_t *telnet) {
+	telnet->paused = 1;
+	telnet->stop = 1;
+}
+
+/* event handler in place while parsing for telnet_next_event(): keeps
+ * the event, and has the parser stop once it is done with the current
+ * byte.  the data an event points to stays put until the parser
+ * resumes, except for error messages, which are copied.  output goes to
+ * the application's handler as usual.  one byte raises at most a
+ * handful of events, so the queue does not fill up; should it anyway,
+ * the event goes to the application's handler too
+ */
+static void _pull_event(telnet_t *telnet, telnet_event_t *ev, void *ud) {
+	telnet_pull_t *pull = telnet->pull;
+	telnet_event_t *slot;
+
+	if (ev->type == TELNET_EV_SEND || ev->type == TELNET_EV_SENDV ||
+			pull->count == PULL_QUEUE_SIZE) {
+		pull->eh(telnet, ev, ud);
+		return;
+	}
+
+	slot = &pull->ev[pull->count];
+	*slot = *ev;
+	if (ev->type == TELNET_EV_ERROR || ev->type == TELNET_EV_WARNING) {
+		strncpy(pull->msg[pull->count], ev->error.msg, ERROR_MSG_SIZE - 1);
+		pull->msg[pull->count][ERROR_MSG_SIZE - 1] = 0;
+		slot->error.msg = pull->msg[pull->count];
+	}
+	++pull->count;
+	telnet->stop = 1;
+}
 
-			/* prepare output buffer for next run */
-			telnet->z->next_out = (unsigned char *)inflate_buffer;
-			telnet->z->avail_out = sizeof(inflate_buffer);
+/* give the state tracker bytes to parse with telnet_next_event() */
+telnet_error_t telnet_feed(telnet_t *telnet, const char *buffer,
+		size_t size) {
+	if (telnet->pull == 0) {
+		if ((telnet->pull = (telnet_pull_t *)_malloc(telnet,
+				sizeof(telnet_pull_t))) == 0)
+			return _error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
+					"malloc() failed: %s", strerror(errno));
+		telnet->pull->count = 0;
+		telnet->pull->next = 0;
+	}
 
-			/* on error (or on end of stream) disable further inflation */
-			if (rs != Z_OK) {
-				telnet_event_t ev;
+	if (telnet->feed_size != 0 || telnet->pull->next != telnet->pull->count)
+		return _error(telnet, __LINE__, __func__, TELNET_EBADVAL, 0,
+				"previous input has not been pulled yet");
 
-				/* disable compression */
-				inflateEnd(telnet->z);
-				free(telnet->z);
-				telnet->z = 0;
+	telnet->stats.recv_bytes += size;
+	telnet->feed = buffer;
+	telnet->feed_size = size;
+	return TELNET_EOK;
+}
 
-				/* send event */
-				ev.type = TELNET_EV_COMPRESS;
-				ev.compress.state = 0;
-				telnet->eh(telnet, &ev, telnet->ud);
+/* pull the next event out of the fed bytes */
+int telnet_next_event(telnet_t *telnet, telnet_event_t *event) {
+	telnet_pull_t *pull = telnet->pull;
+	size_t n;
 
-				break;
-			}
+	if (pull == 0)
+		return 0;
+
+	/* parse on once every event raised so far has been pulled */
+	if (pull->next == pull->count) {
+		pull->count = 0;
+		pull->next = 0;
+		pull->eh = telnet->eh;
+		telnet->eh = _pull_event;
+		telnet->pulling = 1;
+		n = _recv(telnet, telnet->feed, telnet->feed_size, 1);
+		telnet->pulling = 0;
+		telnet->eh = pull->eh;
+		telnet->feed += n;
+		telnet->feed_size -= n;
+		if (pull->count == 0)
+			return 0;
+	}
+
+	*event = pull->ev[pull->next++];
+	return 1;
+}
+
+/* set or allocate the buffer used to coalesce received data runs */
+telnet_error_t telnet_set_data_buffer(telnet_t *telnet, char *buffer,
+		size_t size) {
+	char *data = buffer;
+
+	/* allocate a buffer if the caller did not give us one */
+	if (size != 0 && buffer == 0) {
+		if ((data = (char *)_malloc(telnet, size)) == 0)
+			return _error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
+					"malloc() failed: %s", strerror(errno));
+	}
+
+	/* deliver anything still waiting in the old buffer */
+	_data_flush(telnet, 0, 0);
+	if (telnet->data_owned)
+		_free(telnet, telnet->data);
+
+	telnet->data = size != 0 ? data : 0;
+	telnet->data_size = size;
+	telnet->data_pos = 0;
+	telnet->data_owned = size != 0 && buffer == 0;
+	return TELNET_EOK;
+}
+
+/* set the parser for a telopt's subnegotiations */
+telnet_error_t telnet_set_sb_parser(telnet_t *telnet, unsigned char telopt,
+		telnet_sb_parser_t parser, void *ctx) {
+	size_t i;
+
+	/* the table starts out as the built in parsers */
+	if (telnet->sb_parsers == 0) {
+		if ((telnet->sb_parsers = (telnet_sb_entry_t *)_malloc(telnet,
+				256 * sizeof(telnet_sb_entry_t))) == 0)
+			return _error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
+					"malloc() failed: %s", strerror(errno));
+		for (i = 0; i != 256; ++i) {
+			telnet->sb_parsers[i].parser = _sb_builtin((unsigned char)i);
+			telnet->sb_parsers[i].ctx = 0;
 		}
+	}
 
-	/* COMPRESS2 is not negotiated, just process */
-	} else
+	if (parser == 0) {
+		telnet->sb_parsers[telopt].parser = _sb_builtin(telopt);
+		telnet->sb_parsers[telopt].ctx = 0;
+	} else {
+		telnet->sb_parsers[telopt].parser = parser;
+		telnet->sb_parsers[telopt].ctx = ctx;
+	}
+	return TELNET_EOK;
+}
+
+/* scratch space for a subnegotiation parser */
+void *telnet_scratch(telnet_t *telnet, size_t size) {
+	return _scratch(telnet, size);
+}
+
+/* choose the event types not to raise */
+void telnet_set_event_mask(telnet_t *telnet, unsigned int mask) {
+	/* output has to reach the application whatever it asks for, and
+	 * _subnegotiate() decides for itself which raw subnegotiations to
+	 * skip */
+	telnet->sb_masked =
+			(mask & TELNET_EV_MASK(TELNET_EV_SUBNEGOTIATION)) != 0;
+	telnet->event_mask = mask & ~(TELNET_EV_MASK(TELNET_EV_SEND) |
+			TELNET_EV_MASK(TELNET_EV_SENDV) |
+			TELNET_EV_MASK(TELNET_EV_SUBNEGOTIATION));
+}
+
+/* configure subnegotiation buffer sizing */
+telnet_error_t telnet_set_sb_limits(telnet_t *telnet, size_t initial,
+		unsigned int growth, size_t max, unsigned int shrink_after) {
+	if (initial == 0 || initial > max)
+		return _error(telnet, __LINE__, __func__, TELNET_EBADVAL, 0,
+				"invalid buffer limits: initial=%lu, max=%lu",
+				(unsigned long)initial, (unsigned long)max);
+
+	telnet->buffer_initial = initial;
+	telnet->buffer_growth = growth;
+	telnet->buffer_max = max;
+	telnet->buffer_shrink = shrink_after;
+	telnet->buffer_small = 0;
+
+	/* drop a buffer that is now over the limit, unless it is in use */
+	if (telnet->buffer_size > max &&
+			telnet->state != TELNET_STATE_SB_DATA &&
+			telnet->state != TELNET_STATE_SB_DATA_IAC)
+		telnet_trim(telnet);
+
+	return TELNET_EOK;
+}
+
+/* release buffers that are not currently holding any data */
+void telnet_trim(telnet_t *telnet) {
+	/* events waiting to be pulled may point into any of the buffers */
+	if (telnet->pull != 0 && telnet->pull->next != telnet->pull->count)
+		return;
+
+	/* the subnegotiation buffer is live while a subnegotiation is open,
+	 * and still being parsed after the state has gone back to data */
+	if (telnet->buffer != 0 && !telnet->in_sb &&
+			telnet->state != TELNET_STATE_SB_DATA &&
+			telnet->state != TELNET_STATE_SB_DATA_IAC) {
+		_free(telnet, telnet->buffer);
+		telnet->buffer = 0;
+		telnet->buffer_size = 0;
+		telnet->buffer_pos = 0;
+		telnet->buffer_small = 0;
+	}
+
+	/* the formatting buffer and parser scratch space never hold
+	 * anything between calls, though a parser may be using the
+	 * scratch space while its events are raised */
+	_free(telnet, telnet->fmt);
+	telnet->fmt = 0;
+	telnet->fmt_size = 0;
+	if (!telnet->in_sb) {
+		_free(telnet, telnet->scratch);
+		telnet->scratch = 0;
+		telnet->scratch_size = 0;
+	}
+
+	/* the event queue, unless fed input is still to be pulled */
+	if (telnet->feed_size == 0) {
+		_free(telnet, telnet->pull);
+		telnet->pull = 0;
+	}
+
+#if defined(HAVE_ZLIB)
+	/* streams kept by telnet_reset() */
+	_free_zspare(telnet, 1);
+	_free_zspare(telnet, 0);
+#endif /* defined(HAVE_ZLIB) */
+}
+
+/* buffer output until flushed */
+telnet_error_t telnet_set_send_buffer(telnet_t *telnet, size_t size) {
+	char *send = 0;
+
+	if (size != 0 && (send = (char *)_malloc(telnet, size)) == 0)
+		return _error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
+				"malloc() failed: %s", strerror(errno));
+
+	/* send anything still waiting in the old buffer */
+	_send_flush(telnet);
+	_free(telnet, telnet->send);
+
+	telnet->send = send;
+	telnet->send_size = size;
+	telnet->send_pos = 0;
+	return TELNET_EOK;
+}
+
+/* send any buffered output */
+void telnet_flush(telnet_t *telnet) {
+	_send_flush(telnet);
+
+#if defined(HAVE_ZLIB)
+	/* push out anything the deflate stream is holding back */
+	if (telnet->z_out != 0 && telnet->z_pending != 0) {
+		_deflate(telnet, 0, 0, Z_SYNC_FLUSH);
+		if (telnet->za_window != 0 && telnet->z_out != 0)
+			_adapt_compress(telnet);
+	}
 #endif /* defined(HAVE_ZLIB) */
-		_process(telnet, buffer, size);
+}
+
+/* copy out the statistics counters */
+void telnet_get_stats(telnet_t *telnet, telnet_stats_t *stats) {
+	*stats = telnet->stats;
+
+	/* compressed bytes are replaced by what they stand for */
+	stats->recv_plain = stats->recv_bytes - stats->inflate_in +
+			stats->inflate_out;
+	stats->send_plain = stats->send_bytes - stats->deflate_out +
+			stats->deflate_in;
+}
+
+/* end and restart compression depending on how well it does */
+void telnet_set_compress_adaptive(telnet_t *telnet, size_t window,
+		unsigned int min_ratio, size_t min_flush, size_t restart) {
+#if defined(HAVE_ZLIB)
+	telnet->za_window = window;
+	telnet->za_ratio = min_ratio;
+	telnet->za_flush = min_flush;
+	telnet->za_restart = restart != 0 ? restart : (size_t)-1;
+	telnet->za_in = telnet->za_out = 0;
+	telnet->za_flushes = 0;
+	if (window == 0)
+		telnet->za_off = 0;
+#else
+	(void)telnet;
+	(void)window;
+	(void)min_ratio;
+	(void)min_flush;
+	(void)restart;
+#endif /* defined(HAVE_ZLIB) */
+}
+
+/* choose when compressed output is flushed */
+void telnet_set_compress_flush(telnet_t *telnet, size_t watermark) {
+#if defined(HAVE_ZLIB)
+	/* going back to flushing every write starts with a flush */
+	if (watermark == 0)
+		telnet_flush(telnet);
+	telnet->z_flush = watermark;
+#else
+	(void)telnet;
+	(void)watermark;
+#endif /* defined(HAVE_ZLIB) */
+}
+
+/* set deflate parameters for the next compressed stream */
+telnet_error_t telnet_set_compress_params(telnet_t *telnet, int level,
+		int window_bits, int mem_level, int strategy) {
+#if defined(HAVE_ZLIB)
+	if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION ||
+			window_bits < 9 || window_bits > MAX_WBITS ||
+			mem_level < 1 || mem_level > MAX_MEM_LEVEL ||
+			strategy < Z_DEFAULT_STRATEGY || strategy > Z_FIXED)
+		return _error(telnet, __LINE__, __func__, TELNET_EBADVAL, 0,
+				"invalid compression parameters: level=%d, "
+				"window_bits=%d, mem_level=%d, strategy=%d",
+				level, window_bits, mem_level, strategy);
+
+	telnet->z_level = level;
+	telnet->z_window_bits = window_bits;
+	telnet->z_mem_level = mem_level;
+	telnet->z_strategy = strategy;
+
+	/* a kept stream was set up with the old parameters */
+	_free_zspare(telnet, 1);
+#else
+	(void)telnet;
+	(void)level;
+	(void)window_bits;
+	(void)mem_level;
+	(void)strategy;
+#endif /* defined(HAVE_ZLIB) */
+	return TELNET_EOK;
+}
+
+/* size the buffer compressed input is inflated into */
+telnet_error_t telnet_set_inflate_buffer(telnet_t *telnet, size_t size) {
+#if defined(HAVE_ZLIB)
+	if (size == 0 || size > UINT_MAX)
+		return _error(telnet, __LINE__, __func__, TELNET_EBADVAL, 0,
+				"invalid inflate buffer size: %lu", (unsigned long)size);
+
+	/* an existing buffer is replaced the next time it is needed */
+	telnet->inflate_size = size;
+#else
+	(void)telnet;
+	(void)size;
+#endif /* defined(HAVE_ZLIB) */
+	return TELNET_EOK;
+}
+
+/* allocate zlib memory through the application */
+telnet_error_t telnet_set_compress_alloc(telnet_t *telnet,
+		telnet_zalloc_t zalloc, telnet_zfree_t zfree, void *opaque) {
+#if defined(HAVE_ZLIB)
+	if ((zalloc == 0) != (zfree == 0))
+		return _error(telnet, __LINE__, __func__, TELNET_EBADVAL, 0,
+				"zalloc and zfree must be set together");
+
+	/* memory already handed out must go back where it came from */
+	if (telnet->z_out != 0 || telnet->z_in != 0)
+		return _error(telnet, __LINE__, __func__, TELNET_EBADVAL, 0,
+				"cannot change allocator while compression is active");
+	_free_zspare(telnet, 1);
+	_free_zspare(telnet, 0);
+
+	telnet->z_alloc = zalloc;
+	telnet->z_free = zfree;
+	telnet->z_opaque = opaque;
+#else
+	(void)telnet;
+	(void)zalloc;
+	(void)zfree;
+	(void)opaque;
+#endif /* defined(HAVE_ZLIB) */
+	return TELNET_EOK;
 }
 
 /* send an iac command */
@@ -1235,6 +2715,12 @@ void telnet_iac(telnet_t *telnet, unsigned char cmd) {
 	bytes[0] = TELNET_IAC;
 	bytes[1] = cmd;
 	_sendu(telnet, bytes, 2);
+
+#if defined(HAVE_ZLIB)
+	/* a prompt or record is complete, so don't hold it back */
+	if (telnet->z_flush != 0 && (cmd == TELNET_GA || cmd == TELNET_EOR))
+		telnet_flush(telnet);
+#endif /* defined(HAVE_ZLIB) */
 }
 
 /* send negotiation */
@@ -1322,74 +2808,154 @@ void telnet_negotiate(telnet_t *telnet, unsigned char cmd,
 	}
 }
 
-/* send non-command data (escapes IAC bytes) */
-void telnet_send(telnet_t *telnet, const char *buffer,
-		size_t size) {
-	size_t i, l;
-
-	for (l = i = 0; i != size; ++i) {
-		/* dump prior portion of text, send escaped bytes */
-		if (buffer[i] == (char)TELNET_IAC) {
-			/* dump prior text if any */
-			if (i != l) {
-				_send(telnet, buffer + l, i - l);
-			}
-			l = i + 1;
+/* hand encoded output on; out is either the send buffer or the
+ * encoder's own staging buffer
+ */
+static INLINE void _encode_flush(telnet_t *telnet, char *out, size_t pos) {
+	if (out == telnet->send) {
+		telnet->send_pos = pos;
+		_send_flush(telnet);
+	} else if (pos != 0) {
+		_send_raw(telnet, out, pos);
+	}
+}
 
-			/* send escape */
-			telnet_iac(telnet, TELNET_IAC);
-		}
+/* escape IAC bytes and, if translate is non-zero, turn \r and \n into
+ * CR NUL and CR LF.  plain runs are found with _scan() and copied in
+ * bulk, along with the escapes, into the send buffer if there is one or
+ * a staging buffer otherwise; runs too long to be worth copying are
+ * passed on directly.
+ */
+static void _encode(telnet_t *telnet, const char *buffer, size_t size,
+		int translate) {
+	char staging[ENCODE_BUFFER_SIZE];
+	unsigned char cr = translate ? '\r' : TELNET_IAC;
+	unsigned char lf = translate ? '\n' : TELNET_IAC;
+	char *out = staging;
+	size_t cap = sizeof(staging);
+	size_t pos = 0, i, k, run;
+
+	/* write straight into the send buffer when there is one */
+	if (telnet->send_size >= 2) {
+		out = telnet->send;
+		cap = telnet->send_size;
+		pos = telnet->send_pos;
 	}
 
-	/* send whatever portion of buffer is left */
-	if (i != l) {
-		_send(telnet, buffer + l, i - l);
+	for (i = 0; i != size; i = k + 1) {
+		k = i + _scan(buffer + i, size - i, TELNET_IAC, cr, lf);
+		run = k - i;
+
+		/* leave room for the escape that follows the run */
+		if (pos + run + 2 > cap) {
+			_encode_flush(telnet, out, pos);
+			pos = 0;
+		}
+		if (run + 2 > cap) {
+			_send_raw(telnet, buffer + i, run);
+		} else {
+			memcpy(out + pos, buffer + i, run);
+			pos += run;
+		}
+
+		if (k == size)
+			break;
+
+		/* IAC -> IAC IAC, \r -> CR NUL, \n -> CR LF */
+		if (buffer[k] == (char)TELNET_IAC) {
+			out[pos++] = (char)TELNET_IAC;
+			out[pos++] = (char)TELNET_IAC;
+			++telnet->stats.iac_sent;
+		} else {
+			out[pos++] = '\r';
+			out[pos++] = buffer[k] == '\r' ? '\0' : '\n';
+		}
 	}
+
+	if (out == telnet->send)
+		telnet->send_pos = pos;
+	else
+		_encode_flush(telnet, out, pos);
 }
 
-/* send non-command text (escapes IAC bytes and does NVT translation) */
-void telnet_send_text(telnet_t *telnet, const char *buffer,
+/* send non-command data (escapes IAC bytes) */
+void telnet_send(telnet_t *telnet, const char *buffer,
 		size_t size) {
-	size_t i, l;
-
-	for (l = i = 0; i != size; ++i) {
-		/* dump prior portion of text, send escaped bytes */
-		if (buffer[i] == (char)TELNET_IAC) {
-			/* dump prior text if any */
-			if (i != l) {
-				_send(telnet, buffer + l, i - l);
-			}
-			l = i + 1;
+	_encode(telnet, buffer, size, 0);
+}
 
-			/* send escape */
-			telnet_iac(telnet, TELNET_IAC);
-		}
-		/* special characters if not in BINARY mode */
-		else if (!(telnet->flags & TELNET_FLAG_TRANSMIT_BINARY) &&
-				 (buffer[i] == '\r' || buffer[i] == '\n')) {
-			/* dump prior portion of text */
-			if (i != l) {
-				_send(telnet, buffer + l, i - l);
-			}
-			l = i + 1;
+/* send non-command data from several buffers (escapes IAC bytes) */
+void telnet_sendv(telnet_t *telnet, const telnet_iovec_t *iov,
+		size_t count) {
+	telnet_iovec_t out[SENDV_IOV_MAX];
+	telnet_event_t ev;
+	const char *buffer;
+	size_t i, n, k, size, skip;
 
-			/* automatic translation of \r -> CRNUL */
-			if (buffer[i] == '\r') {
-				_send(telnet, CRNUL, 2);
+	/* if the output gets copied anyway, let _send() do it */
+	if (telnet->send_size != 0
+#if defined(HAVE_ZLIB)
+			|| telnet->z_out != 0
+#endif /* defined(HAVE_ZLIB) */
+			) {
+		for (i = 0; i != count; ++i)
+			telnet_send(telnet, iov[i].buffer, iov[i].size);
+		return;
+	}
+
+	/* every byte goes out once, plus once more for each IAC */
+	for (i = 0; i != count; ++i)
+		telnet->stats.send_bytes += iov[i].size;
+
+	ev.type = TELNET_EV_SENDV;
+	ev.sendv.iov = out;
+
+	for (n = i = 0; i != count; ++i) {
+		buffer = iov[i].buffer;
+		size = iov[i].size;
+
+		/* each IAC ends one entry and starts the next, so the caller's
+		 * byte is referenced twice and comes out escaped
+		 */
+		for (skip = 0; size != 0; skip = 1) {
+			if (n == SENDV_IOV_MAX) {
+				ev.sendv.count = n;
+				_event(telnet, &ev);
+				n = 0;
 			}
-			/* automatic translation of \n -> CRLF */
-			else {
-				_send(telnet, CRLF, 2);
+
+			k = skip + _scan(buffer + skip, size - skip, TELNET_IAC,
+					TELNET_IAC, TELNET_IAC);
+			if (k == size) {
+				out[n].buffer = buffer;
+				out[n].size = size;
+				++n;
+				break;
 			}
+
+			out[n].buffer = buffer;
+			out[n].size = k + 1;
+			++n;
+			++telnet->stats.iac_sent;
+			++telnet->stats.send_bytes;
+			buffer += k;
+			size -= k;
 		}
 	}
 
-	/* send whatever portion of buffer is left */
-	if (i != l) {
-		_send(telnet, buffer + l, i - l);
+	if (n != 0) {
+		ev.sendv.count = n;
+		_event(telnet, &ev);
 	}
 }
 
+/* send non-command text (escapes IAC bytes and does NVT translation) */
+void telnet_send_text(telnet_t *telnet, const char *buffer,
+		size_t size) {
+	_encode(telnet, buffer, size,
+			!(telnet->flags & TELNET_FLAG_TRANSMIT_BINARY));
+}
+
 /* send subnegotiation header */
 void telnet_begin_sb(telnet_t *telnet, unsigned char telopt) {
 	unsigned char sb[3];
@@ -1415,113 +2981,216 @@ void telnet_subnegotiation(telnet_t *telnet, unsigned char telopt,
 	_sendu(telnet, bytes + 3, 2);
 
 #if defined(HAVE_ZLIB)
-	/* if we're a proxy and we just sent the COMPRESS2 marker, we must
-	 * make sure all further data is compressed if not already.
+	/* if we're a proxy and we just sent the COMPRESS2 or COMPRESS3
+	 * marker, we must make sure all further data is compressed if not
+	 * already.
 	 */
 	if (telnet->flags & TELNET_FLAG_PROXY &&
-			telopt == TELNET_TELOPT_COMPRESS2) {
+			(telopt == TELNET_TELOPT_COMPRESS2 ||
+			telopt == TELNET_TELOPT_COMPRESS3)) {
 		telnet_event_t ev;
 
+		/* the marker and everything before it go out uncompressed */
+		_send_flush(telnet);
 		if (_init_zlib(telnet, 1, 1) != TELNET_EOK)
 			return;
+		telnet->z_out_telopt = telopt;
 
 		/* notify app that compression was enabled */
 		ev.type = TELNET_EV_COMPRESS;
 		ev.compress.state = 1;
-		telnet->eh(telnet, &ev, telnet->ud);
+		ev.compress.telopt = telopt;
+		_event(telnet, &ev);
 	}
 #endif /* defined(HAVE_ZLIB) */
 }
 
 void telnet_begin_compress2(telnet_t *telnet) {
 #if defined(HAVE_ZLIB)
-	static const unsigned char compress2[] = { TELNET_IAC, TELNET_SB,
-			TELNET_TELOPT_COMPRESS2, TELNET_IAC, TELNET_SE };
+	/* output buffered so far must not be compressed */
+	_send_flush(telnet);
+	_start_compress(telnet, TELNET_TELOPT_COMPRESS2);
+#else
+	(void)telnet;
+#endif /* defined(HAVE_ZLIB) */
+}
 
-	telnet_event_t ev;
+/* begin sending MCCP3 compressed data (client side) */
+void telnet_begin_compress3(telnet_t *telnet) {
+#if defined(HAVE_ZLIB)
+	/* output buffered so far must not be compressed */
+	_send_flush(telnet);
+	_start_compress(telnet, TELNET_TELOPT_COMPRESS3);
+#else
+	(void)telnet;
+#endif /* defined(HAVE_ZLIB) */
+}
 
-	/* attempt to create output stream first, bail if we can't */
-	if (_init_zlib(telnet, 1, 0) != TELNET_EOK)
+#if defined(HAVE_ZLIB)
+/* end compression of output, if it was started for telopt */
+static void _stop_compress(telnet_t *telnet, unsigned char telopt) {
+	if (telnet->z_out_telopt != telopt)
 		return;
 
-	/* send compression marker.  we send directly to the event handler
-	 * instead of passing through _send because _send would result in
-	 * the compress marker itself being compressed.
-	 */
-	ev.type = TELNET_EV_SEND;
-	ev.data.buffer = (const char*)compress2;
-	ev.data.size = sizeof(compress2);
-	telnet->eh(telnet, &ev, telnet->ud);
+	/* output buffered so far still belongs in the compressed stream */
+	_send_flush(telnet);
+	telnet->za_off = 0;
+	if (telnet->z_out != 0)
+		_end_compress(telnet, 0);
+}
+#endif /* defined(HAVE_ZLIB) */
 
-	/* notify app that compression was successfully enabled */
-	ev.type = TELNET_EV_COMPRESS;
-	ev.compress.state = 1;
-	telnet->eh(telnet, &ev, telnet->ud);
+/* end MCCP2 compression of output (server side) */
+void telnet_end_compress2(telnet_t *telnet) {
+#if defined(HAVE_ZLIB)
+	_stop_compress(telnet, TELNET_TELOPT_COMPRESS2);
 #else
 	(void)telnet;
 #endif /* defined(HAVE_ZLIB) */
 }
 
-/* send formatted data with \r and \n translation in addition to IAC IAC */
-int telnet_vprintf(telnet_t *telnet, const char *fmt, va_list va) {
+/* end MCCP3 compression of output (client side) */
+void telnet_end_compress3(telnet_t *telnet) {
+#if defined(HAVE_ZLIB)
+	_stop_compress(telnet, TELNET_TELOPT_COMPRESS3);
+#else
+	(void)telnet;
+#endif /* defined(HAVE_ZLIB) */
+}
+
+/* grow the retained formatting buffer to hold at least size bytes */
+static char *_format_reserve(telnet_t *telnet, size_t size) {
+	char *fmt;
+
+	if (size <= telnet->fmt_size)
+		return telnet->fmt;
+	if (size < FORMAT_BUFFER_SIZE)
+		size = FORMAT_BUFFER_SIZE;
+
+	/* nothing in the buffer needs to survive */
+	if ((fmt = (char *)_realloc(telnet, telnet->fmt, 0, size)) == 0) {
+		_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
+				"realloc() failed: %s", strerror(errno));
+		return 0;
+	}
+
+	telnet->fmt = fmt;
+	telnet->fmt_size = size;
+	return fmt;
+}
+
+/* escape size bytes at buffer in place, expanding them backwards into
+ * the count bytes of room that follow; count must be the number of
+ * bytes that need escaping
+ */
+static void _encode_inplace(telnet_t *telnet, char *buffer, size_t size,
+		size_t count, int translate) {
+	size_t src = size, dst = size + count;
+	char c;
+
+	while (count != 0) {
+		c = buffer[--src];
+		if (c == (char)TELNET_IAC) {
+			buffer[--dst] = (char)TELNET_IAC;
+			buffer[--dst] = (char)TELNET_IAC;
+			++telnet->stats.iac_sent;
+			--count;
+		} else if (translate && (c == '\r' || c == '\n')) {
+			buffer[--dst] = c == '\r' ? '\0' : '\n';
+			buffer[--dst] = '\r';
+			--count;
+		} else {
+			buffer[--dst] = c;
+		}
+	}
+}
+
+/* format and send; the text is formatted straight into the free tail of
+ * the send buffer and escaped there when it fits, and otherwise into a
+ * buffer kept by the connection, so the format normally runs once and
+ * nothing is allocated per call.  a tail smaller than the stack buffer
+ * is passed over, as text too long for it would be formatted twice
+ */
+static int _vformat(telnet_t *telnet, int translate, const char *fmt,
+		va_list va) {
+	unsigned char cr = translate ? '\r' : TELNET_IAC;
+	unsigned char lf = translate ? '\n' : TELNET_IAC;
+	char stack[FORMAT_BUFFER_SIZE];
+	char *output;
 	va_list va_temp;
-	char buffer[1024];
-	char *output = buffer;
-	unsigned int rs, i, l;
+	size_t space, count, i;
+	int rs;
 
-	/* format */
-	va_copy(va_temp, va);
-	rs = vsnprintf(buffer, sizeof(buffer), fmt, va_temp);
-	va_end(va_temp);
+	if (telnet->send_size - telnet->send_pos >= sizeof(stack)) {
+		output = telnet->send + telnet->send_pos;
+		space = telnet->send_size - telnet->send_pos;
 
-	if (rs >= sizeof(buffer)) {
-		output = (char*)malloc(rs + 1);
-		if (output == 0) {
-			_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
-					"malloc() failed: %s", strerror(errno));
+		va_copy(va_temp, va);
+		rs = vsnprintf(output, space, fmt, va_temp);
+		va_end(va_temp);
+		if (rs < 0)
 			return -1;
+
+		if ((size_t)rs < space) {
+			/* count the bytes that will need escaping */
+			for (count = i = 0; ; ++i, ++count) {
+				i += _scan(output + i, (size_t)rs - i, TELNET_IAC, cr, lf);
+				if (i == (size_t)rs)
+					break;
+			}
+
+			if ((size_t)rs + count <= space) {
+				_encode_inplace(telnet, output, (size_t)rs, count, translate);
+				telnet->send_pos += (size_t)rs + count;
+				return rs;
+			}
+
+			/* the escaped text does not fit; move it out of the way,
+			 * since _encode() writes to the send buffer */
+			if (_format_reserve(telnet, (size_t)rs) == 0)
+				return -1;
+			memcpy(telnet->fmt, output, (size_t)rs);
+			_encode(telnet, telnet->fmt, (size_t)rs, translate);
+			return rs;
 		}
+	} else {
+		/* the retained buffer, once there is one, is at least as
+		 * large as the stack buffer */
+		output = telnet->fmt != 0 ? telnet->fmt : stack;
+		space = telnet->fmt != 0 ? telnet->fmt_size : sizeof(stack);
 
 		va_copy(va_temp, va);
-		rs = vsnprintf(output, rs + 1, fmt, va_temp);
+		rs = vsnprintf(output, space, fmt, va_temp);
 		va_end(va_temp);
-	}
+		if (rs < 0)
+			return -1;
 
-	/* send */
-	for (l = i = 0; i != rs; ++i) {
-		/* special characters */
-		if (output[i] == (char)TELNET_IAC || output[i] == '\r' ||
-				output[i] == '\n') {
-			/* dump prior portion of text */
-			if (i != l)
-				_send(telnet, output + l, i - l);
-			l = i + 1;
-
-			/* IAC -> IAC IAC */
-			if (output[i] == (char)TELNET_IAC)
-				telnet_iac(telnet, TELNET_IAC);
-			/* automatic translation of \r -> CRNUL */
-			else if (output[i] == '\r')
-				_send(telnet, CRNUL, 2);
-			/* automatic translation of \n -> CRLF */
-			else if (output[i] == '\n')
-				_send(telnet, CRLF, 2);
+		if ((size_t)rs < space) {
+			_encode(telnet, output, (size_t)rs, translate);
+			return rs;
 		}
 	}
 
-	/* send whatever portion of output is left */
-	if (i != l) {
-		_send(telnet, output + l, i - l);
-	}
+	/* too long for the space we had; grow the retained buffer to fit
+	 * and format again */
+	if ((output = _format_reserve(telnet, (size_t)rs + 1)) == 0)
+		return -1;
 
-	/* free allocated memory, if any */
-	if (output != buffer) {
-		free(output);
-	}
+	va_copy(va_temp, va);
+	rs = vsnprintf(output, (size_t)rs + 1, fmt, va_temp);
+	va_end(va_temp);
+	if (rs < 0)
+		return -1;
 
+	_encode(telnet, output, (size_t)rs, translate);
 	return rs;
 }
 
+/* send formatted data with \r and \n translation in addition to IAC IAC */
+int telnet_vprintf(telnet_t *telnet, const char *fmt, va_list va) {
+	return _vformat(telnet, 1, fmt, va);
+}
+
 /* see telnet_vprintf */
 int telnet_printf(telnet_t *telnet, const char *fmt, ...) {
 	va_list va;
@@ -1536,38 +3205,7 @@ int telnet_printf(telnet_t *telnet, const char *fmt, ...) {
 
 /* send formatted data through telnet_send */
 int telnet_raw_vprintf(telnet_t *telnet, const char *fmt, va_list va) {
-	va_list va_temp;
-	char buffer[1024];
-	char *output = buffer;
-	unsigned int rs;
-
-	/* format; allocate more space if necessary */
-	va_copy(va_temp, va);
-	rs = vsnprintf(buffer, sizeof(buffer), fmt, va_temp);
-	va_end(va_temp);
-
-	if (rs >= sizeof(buffer)) {
-		output = (char*)malloc(rs + 1);
-		if (output == 0) {
-			_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
-					"malloc() failed: %s", strerror(errno));
-			return -1;
-		}
-
-		va_copy(va_temp, va);
-		rs = vsnprintf(output, rs + 1, fmt, va_temp);
-		va_end(va_temp);
-	}
-
-	/* send out the formatted data */
-	telnet_send(telnet, output, rs);
-
-	/* release allocated memory, if any */
-	if (output != buffer) {
-		free(output);
-	}
-
-	return rs;
+	return _vformat(telnet, 0, fmt, va);
 }
 
 /* see telnet_raw_vprintf */
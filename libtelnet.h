@@ -13,7 +13,7 @@
  * the actual socket connection.
  *
  * Features supported include the full TELNET protocol, Q-method option
- * negotiation, ZMP, MCCP2, MSSP, and NEW-ENVIRON.
+ * negotiation, ZMP, MCCP2, MCCP3, MSSP, and NEW-ENVIRON.
  *
  * CONFORMS TO:
  *
@@ -72,6 +72,31 @@ typedef union telnet_event_t telnet_event_t;
 /*! Telnet option table element type. */
 typedef struct telnet_telopt_t telnet_telopt_t;
 
+/*! zlib memory allocation hook; called as zlib's zalloc. */
+typedef void *(*telnet_zalloc_t)(void *opaque, unsigned int items,
+		unsigned int size);
+
+/*! zlib memory release hook; called as zlib's zfree. */
+typedef void (*telnet_zfree_t)(void *opaque, void *address);
+
+/*! Memory allocation hook; returns size bytes, or 0 on failure. */
+typedef void *(*telnet_malloc_t)(void *ctx, size_t size);
+
+/*! Memory reallocation hook; behaves as realloc(). */
+typedef void *(*telnet_realloc_t)(void *ctx, void *ptr, size_t size);
+
+/*! Memory release hook; ptr is never 0. */
+typedef void (*telnet_free_t)(void *ctx, void *ptr);
+
+/*! Allocator type, see telnet_init_ex(). */
+typedef struct telnet_allocator_t telnet_allocator_t;
+
+/*! Scatter-gather buffer element type. */
+typedef struct telnet_iovec_t telnet_iovec_t;
+
+/*! Connection statistics type. */
+typedef struct telnet_stats_t telnet_stats_t;
+
 /*! \name Telnet commands */
 /*@{*/
 /*! Telnet commands and special values. */
@@ -143,10 +168,12 @@ typedef struct telnet_telopt_t telnet_telopt_t;
 #define TELNET_TELOPT_MSSP 70
 #define TELNET_TELOPT_COMPRESS 85
 #define TELNET_TELOPT_COMPRESS2 86
+#define TELNET_TELOPT_COMPRESS3 87
 #define TELNET_TELOPT_ZMP 93
 #define TELNET_TELOPT_EXOPL 255
 
 #define TELNET_TELOPT_MCCP2 86
+#define TELNET_TELOPT_MCCP3 87
 /*@}*/
 
 /*! \name Protocol codes for TERMINAL-TYPE commands. */
@@ -218,10 +245,25 @@ enum telnet_event_type_t {
 	TELNET_EV_ENVIRON,         /*!< ENVIRON command has been received */
 	TELNET_EV_MSSP,            /*!< MSSP command has been received */
 	TELNET_EV_WARNING,         /*!< recoverable error has occured */
-	TELNET_EV_ERROR            /*!< non-recoverable error has occured */
+	TELNET_EV_ERROR,           /*!< non-recoverable error has occured */
+	TELNET_EV_SENDV            /*!< buffers need to be sent to the peer */
 };
 typedef enum telnet_event_type_t telnet_event_type_t; /*!< Telnet event type. */
 
+/*! Number of event types. */
+#define TELNET_EV_COUNT (TELNET_EV_SENDV + 1)
+
+/*! Bit for an event type in the mask given to telnet_set_event_mask(). */
+#define TELNET_EV_MASK(type) (1U << (type))
+
+/*!
+ * scatter-gather buffer, laid out for conversion to a struct iovec
+ */
+struct telnet_iovec_t {
+	const char *buffer; /*!< byte buffer */
+	size_t size;        /*!< number of bytes in buffer */
+};
+
 /*! 
  * environ/MSSP command information 
  */
@@ -254,6 +296,15 @@ union telnet_event_t {
 		size_t size;                    /*!< number of bytes in buffer */
 	} data; /*!< DATA and SEND */
 
+	/*!
+	 * scatter-gather send event: for SENDV
+	 */
+	struct sendv_t {
+		enum telnet_event_type_t _type; /*!< alias for type */
+		const telnet_iovec_t *iov;      /*!< array of buffers, in order */
+		size_t count;                   /*!< number of elements in iov */
+	} sendv; /*!< SENDV */
+
 	/*! 
 	 * WARNING and ERROR events 
 	 */
@@ -317,6 +368,7 @@ union telnet_event_t {
 		enum telnet_event_type_t _type; /*!< alias for type */
 		unsigned char state;            /*!< 1 if compression is enabled,
 	                                         0 if disabled */
+		unsigned char telopt;           /*!< COMPRESS2 or COMPRESS3 */
 	} compress; /*!< COMPRESS */
 
 	/*! 
@@ -354,6 +406,19 @@ union telnet_event_t {
 typedef void (*telnet_event_handler_t)(telnet_t *telnet,
 		telnet_event_t *event, void *user_data);
 
+/*!
+ * \brief Subnegotiation parser function, see telnet_set_sb_parser().
+ *
+ * \param telnet Telnet state tracker object.
+ * \param telopt Telopt of the subnegotiation.
+ * \param buffer Subnegotiation data, without the IAC SB telopt and
+ *               IAC SE framing and with escaped IAC bytes undone.
+ * \param size   Number of bytes in buffer.
+ * \param ctx    Pointer given to telnet_set_sb_parser().
+ */
+typedef void (*telnet_sb_parser_t)(telnet_t *telnet, unsigned char telopt,
+		const char *buffer, size_t size, void *ctx);
+
 /*! 
  * telopt support table element; use telopt of -1 for end marker 
  */
@@ -363,6 +428,39 @@ struct telnet_telopt_t {
 	unsigned char him; /*!< TELNET_DO or TELNET_DONT */
 };
 
+/*!
+ * connection statistics, see telnet_get_stats(); counters wrap around
+ * rather than saturate
+ */
+struct telnet_stats_t {
+	size_t recv_bytes;   /*!< bytes passed to telnet_recv() */
+	size_t recv_plain;   /*!< received bytes after decompression */
+	size_t send_bytes;   /*!< bytes handed to SEND and SENDV events */
+	size_t send_plain;   /*!< sent bytes before compression */
+	size_t events[TELNET_EV_COUNT]; /*!< events raised, by type */
+	size_t sb_count;     /*!< subnegotiations received */
+	size_t sb_max;       /*!< size of the largest subnegotiation */
+	size_t sb_overflows; /*!< subnegotiations cut short by the size limit */
+	size_t iac_recv;     /*!< escaped IAC bytes received */
+	size_t iac_sent;     /*!< IAC bytes escaped on output */
+	size_t negotiations; /*!< WILL, WONT, DO and DONT commands received */
+	size_t round_trips;  /*!< replies to negotiations we started */
+	size_t inflate_in;   /*!< compressed bytes inflated */
+	size_t inflate_out;  /*!< bytes produced by inflate */
+	size_t deflate_in;   /*!< bytes fed to deflate */
+	size_t deflate_out;  /*!< compressed bytes produced by deflate */
+};
+
+/*!
+ * memory allocator used for a state tracker, see telnet_init_ex()
+ */
+struct telnet_allocator_t {
+	telnet_malloc_t malloc_hook;   /*!< allocates memory; required */
+	telnet_realloc_t realloc_hook; /*!< resizes memory; optional */
+	telnet_free_t free_hook;       /*!< releases memory; required */
+	void *ctx;                     /*!< passed to every hook */
+};
+
 /*! 
  * state tracker -- private data structure 
  */
@@ -376,6 +474,7 @@ struct telnet_t;
  * telnet state tracker object.
  *
  * \param telopts   Table of TELNET options the application supports.
+ *                  The table is read once and need not outlive the call.
  * \param eh        Event handler function called for every event.
  * \param flags     0 or TELNET_FLAG_PROXY.
  * \param user_data Optional data pointer that will be passsed to eh.
@@ -384,12 +483,84 @@ struct telnet_t;
 extern telnet_t* telnet_init(const telnet_telopt_t *telopts,
 		telnet_event_handler_t eh, unsigned char flags, void *user_data);
 
+/*!
+ * \brief Initialize a telnet state tracker using an allocator.
+ *
+ * Like telnet_init(), but every allocation the state tracker makes,
+ * the tracker itself included, goes through the given allocator, so a
+ * worker can serve its connections from its own arena or slab.  zlib's
+ * memory is allocated through it as well, unless
+ * telnet_set_compress_alloc() is used.  Without a realloc_hook, memory
+ * is resized by allocating, copying and releasing.  The allocator is
+ * copied; ctx must stay valid until telnet_free().
+ *
+ * \param telopts   Table of TELNET options the application supports.
+ * \param eh        Event handler function called for every event.
+ * \param flags     0 or TELNET_FLAG_PROXY.
+ * \param user_data Optional data pointer that will be passsed to eh.
+ * \param allocator Allocator to use, or 0 for malloc() and free().
+ * \return Telnet state tracker object, or 0 if it could not be
+ *         allocated or the allocator lacks malloc_hook or free_hook.
+ */
+extern telnet_t* telnet_init_ex(const telnet_telopt_t *telopts,
+		telnet_event_handler_t eh, unsigned char flags, void *user_data,
+		const telnet_allocator_t *allocator);
+
+/*!
+ * \brief Size of the memory a state tracker occupies.
+ *
+ * \return Number of bytes telnet_init_inplace() needs.
+ */
+extern size_t telnet_sizeof(void);
+
+/*!
+ * \brief Initialize a telnet state tracker in caller owned memory.
+ *
+ * Like telnet_init_ex(), but the state tracker is placed in mem rather
+ * than allocated, so it can be embedded in the application's own
+ * connection structure or taken from a pool.  mem must be at least
+ * telnet_sizeof() bytes and suitably aligned for any type, as memory
+ * from malloc() is.  Memory the tracker needs later on still comes
+ * from the allocator.  telnet_free() releases that memory but leaves
+ * mem itself to the application.
+ *
+ * \param mem       Memory to hold the state tracker.
+ * \param telopts   Table of TELNET options the application supports.
+ * \param eh        Event handler function called for every event.
+ * \param flags     0 or TELNET_FLAG_PROXY.
+ * \param user_data Optional data pointer that will be passsed to eh.
+ * \param allocator Allocator to use, or 0 for malloc() and free().
+ * \return mem as a state tracker, or 0 if mem is 0 or the allocator
+ *         lacks malloc_hook or free_hook.
+ */
+extern telnet_t* telnet_init_inplace(void *mem,
+		const telnet_telopt_t *telopts, telnet_event_handler_t eh,
+		unsigned char flags, void *user_data,
+		const telnet_allocator_t *allocator);
+
+/*!
+ * \brief Return a state tracker to its initial state.
+ *
+ * Prepares a state tracker for a new connection, as if it had just
+ * been initialized: option negotiation states, the parser state,
+ * binary mode, statistics and any partly received or buffered data
+ * are cleared, and compression is stopped without sending anything.
+ * The option table, event handler, user data, flags and settings are
+ * kept, and so is the memory already allocated: the subnegotiation
+ * buffer, and the zlib streams, which are reset and reused the next
+ * time compression starts.  No events are generated.
+ *
+ * \param telnet Telnet state tracker object.
+ */
+extern void telnet_reset(telnet_t *telnet);
+
 /*!
  * \brief Free up any memory allocated by a state tracker.
  *
  * This function must be called when a telnet state tracker is no
  * longer needed (such as after the connection has been closed) to
- * release any memory resources used by the state tracker.
+ * release any memory resources used by the state tracker.  For a
+ * tracker from telnet_init_inplace(), its own memory is left alone.
  *
  * \param telnet Telnet state tracker object.
  */
@@ -410,6 +581,369 @@ extern void telnet_free(telnet_t *telnet);
 extern void telnet_recv(telnet_t *telnet, const char *buffer,
 		size_t size);
 
+/*!
+ * \brief Push a byte buffer into the state tracker, stopping early if
+ *        the event handler pauses.
+ *
+ * Works like telnet_recv(), except that parsing stops once the event
+ * handler calls telnet_pause().  The bytes that were not consumed
+ * must be passed in again, at the start of a later call, to resume.
+ * Data already parsed when the handler paused may still be passed on
+ * in one more TELNET_EV_DATA event before this returns.
+ *
+ * With compressed input, bytes are not counted as consumed until all
+ * of their decompressed output has been parsed, so every event is
+ * raised by the time the whole buffer has been consumed.  Passed in
+ * again, they are not decompressed twice.  A call that only parses
+ * output from earlier bytes consumes nothing and returns 0.
+ *
+ * \param telnet Telnet state tracker object.
+ * \param buffer Pointer to byte buffer.
+ * \param size   Number of bytes pointed to by buffer.
+ * \return Number of bytes consumed, size unless the handler paused.
+ */
+extern size_t telnet_recv_partial(telnet_t *telnet, const char *buffer,
+		size_t size);
+
+/*!
+ * \brief Ask telnet_recv_partial() to stop after the current byte.
+ *
+ * Meant to be called from the event handler, to apply backpressure
+ * when the application cannot take more events for now.  It has no
+ * effect on telnet_recv(), which always consumes the whole buffer.
+ *
+ * \param telnet Telnet state tracker object.
+ */
+extern void telnet_pause(telnet_t *telnet);
+
+/*!
+ * \brief Give the state tracker bytes to pull events out of.
+ *
+ * An alternative to telnet_recv() for applications that would rather
+ * handle received events in their own loop than in the event handler:
+ * the bytes are parsed bit by bit as telnet_next_event() is called.
+ * The buffer is not copied and must stay valid until
+ * telnet_next_event() returns 0.  Output, such as replies to option
+ * negotiation, is still delivered to the event handler as
+ * TELNET_EV_SEND events.
+ *
+ * \param telnet Telnet state tracker object.
+ * \param buffer Pointer to byte buffer.
+ * \param size   Number of bytes pointed to by buffer.
+ * \return TELNET_EOK on success, TELNET_EBADVAL if events from earlier
+ *         input are still to be pulled, or TELNET_ENOMEM.
+ */
+extern telnet_error_t telnet_feed(telnet_t *telnet, const char *buffer,
+		size_t size);
+
+/*!
+ * \brief Pull the next event out of the bytes given to telnet_feed().
+ *
+ * Parses the fed bytes just far enough to produce the next event, and
+ * returns it instead of calling the event handler.  Events carry the
+ * same pointers telnet_recv() would pass, into the fed buffer or the
+ * state tracker's own buffers, without extra copies; they stay valid
+ * until the next call of telnet_next_event().  Call it until it returns
+ * 0 before feeding more input.
+ *
+ * \param telnet Telnet state tracker object.
+ * \param event  Filled in with the next event.
+ * \return 1 if an event was returned, or 0 once the input is used up.
+ */
+extern int telnet_next_event(telnet_t *telnet, telnet_event_t *event);
+
+/*!
+ * \brief Coalesce received data into one event per run.
+ *
+ * By default every escaped IAC IAC sequence in the received stream splits
+ * the surrounding data and is delivered as its own one byte TELNET_EV_DATA
+ * event, as is the CR of a translated NVT CR NUL sequence.  With a data
+ * buffer set, those bytes are unescaped into the buffer instead, and each
+ * contiguous run of data within a telnet_recv() call is delivered as a
+ * single TELNET_EV_DATA event.  Runs that needed no unescaping are still
+ * passed straight from the buffer given to telnet_recv() without a copy.
+ * A run longer than the data buffer is delivered in buffer sized pieces.
+ *
+ * \param telnet Telnet state tracker object.
+ * \param buffer Buffer to unescape data into, or 0 to have libtelnet
+ *               allocate one of the given size.
+ * \param size   Size of the buffer in bytes, or 0 to disable coalescing.
+ * \return TELNET_EOK on success, or TELNET_ENOMEM if allocation failed.
+ */
+extern telnet_error_t telnet_set_data_buffer(telnet_t *telnet,
+		char *buffer, size_t size);
+
+/*!
+ * \brief Choose event types that are not raised.
+ *
+ * Masked events are not passed to the event handler or counted in the
+ * statistics, and the work of producing them is skipped where it can
+ * be: a masked TELNET_EV_WARNING or TELNET_EV_ERROR message is never
+ * formatted, and a subnegotiation whose parsed event (TELNET_EV_ZMP,
+ * TELNET_EV_TTYPE, TELNET_EV_ENVIRON or TELNET_EV_MSSP) is masked is not
+ * parsed.  An application that only handles the parsed events can mask
+ * TELNET_EV_SUBNEGOTIATION to get each subnegotiation once: the raw
+ * event is then skipped only for telopts that have a parser, built in
+ * (ZMP, TTYPE, ENVIRON, NEW-ENVIRON, MSSP and, with zlib, COMPRESS2 and
+ * COMPRESS3) or set with telnet_set_sb_parser(), and still raised for
+ * all others, such as GMCP, which would otherwise not be seen at all.
+ * TELNET_EV_SEND and TELNET_EV_SENDV cannot be masked.  Protocol
+ * handling, such as option negotiation and compression, is unchanged.
+ *
+ * \param telnet Telnet state tracker object.
+ * \param mask   TELNET_EV_MASK() bits of the event types to skip, or 0
+ *               to raise every event.
+ */
+extern void telnet_set_event_mask(telnet_t *telnet, unsigned int mask);
+
+/*!
+ * \brief Set the parser for a telopt's subnegotiations.
+ *
+ * Every subnegotiation is raised as a TELNET_EV_SUBNEGOTIATION event,
+ * then handed to the parser set for its telopt, found by direct
+ * lookup in a 256 entry table.  Out of the box the table holds the
+ * built in parsers for ZMP, TTYPE, ENVIRON, NEW-ENVIRON, MSSP, and
+ * with zlib COMPRESS2 and COMPRESS3, which raise the parsed events.
+ * A parser set here replaces the built in one, and may parse into
+ * telnet_scratch() instead of allocating.  The buffer it is given is
+ * only valid until it returns and must not be modified.  The table is
+ * allocated the first time this is called.
+ *
+ * \param telnet Telnet state tracker object.
+ * \param telopt Telopt to set the parser for.
+ * \param parser Parser function, or 0 to go back to the built in
+ *               parser, if there is one.
+ * \param ctx    Pointer passed on to the parser.
+ * \return TELNET_EOK on success, or TELNET_ENOMEM if the table could
+ *         not be allocated.
+ */
+extern telnet_error_t telnet_set_sb_parser(telnet_t *telnet,
+		unsigned char telopt, telnet_sb_parser_t parser, void *ctx);
+
+/*!
+ * \brief Get scratch space for a subnegotiation parser.
+ *
+ * Returns the per-connection scratch space the built in parsers build
+ * their events in, grown to at least size bytes.  The contents are not
+ * kept: the space is reused by the next subnegotiation, and freed by
+ * telnet_trim().
+ *
+ * \param telnet Telnet state tracker object.
+ * \param size   Number of bytes needed.
+ * \return Pointer to the space, or 0 if it could not be allocated, in
+ *         which case a TELNET_EV_WARNING with TELNET_ENOMEM is raised.
+ */
+extern void *telnet_scratch(telnet_t *telnet, size_t size);
+
+/*!
+ * \brief Configure the subnegotiation buffer.
+ *
+ * Subnegotiations are collected in a per-connection buffer that is
+ * allocated when the first one arrives and grown as needed.  By default
+ * the buffer starts at 512 bytes, grows by a factor of 4 and is limited
+ * to 16384 bytes; a larger subnegotiation produces a TELNET_EOVERFLOW
+ * error and is discarded.  The buffer is normally kept once it has
+ * grown.  With shrink_after set, it is cut back to its initial size
+ * after that many consecutive subnegotiations fit in the initial size.
+ *
+ * \param telnet       Telnet state tracker object.
+ * \param initial      Size of the first allocation.
+ * \param growth       Factor to grow the buffer by; a value below 2 grows
+ *                     it straight to max.
+ * \param max          Largest subnegotiation that will be accepted.
+ * \param shrink_after Number of small subnegotiations before the buffer
+ *                     is shrunk, or 0 to never shrink it.
+ * \return TELNET_EOK on success, or TELNET_EBADVAL if initial is 0 or
+ *         larger than max.
+ */
+extern telnet_error_t telnet_set_sb_limits(telnet_t *telnet,
+		size_t initial, unsigned int growth, size_t max,
+		unsigned int shrink_after);
+
+/*!
+ * \brief Release memory not currently in use.
+ *
+ * Frees the subnegotiation buffer unless a subnegotiation is in
+ * progress, the buffer kept for formatting long telnet_printf()
+ * output, and the scratch space the ENVIRON, MSSP, ZMP and TTYPE
+ * parsers build their events in.  They are allocated again when next
+ * needed.  Useful for connections that have gone idle.  Does nothing
+ * while events are waiting to be pulled with telnet_next_event().
+ * Safe to call from the event handler; while a subnegotiation is being
+ * handled, its buffer and the scratch space are kept.
+ *
+ * \param telnet Telnet state tracker object.
+ */
+extern void telnet_trim(telnet_t *telnet);
+
+/*!
+ * \brief Buffer outgoing data until it is flushed.
+ *
+ * Normally every piece of output (each run of text, each escaped IAC,
+ * each EOL sequence) is delivered in its own TELNET_EV_SEND event.  With
+ * a send buffer, output is collected instead, and delivered in a single
+ * TELNET_EV_SEND event when telnet_flush() is called or when the buffer
+ * fills up.  Writes larger than the buffer are passed straight through.
+ * When compression is enabled, the buffered data is compressed as it is
+ * flushed.
+ *
+ * The application must call telnet_flush() once it has finished
+ * producing output, such as at the end of each event loop iteration.
+ * Data still buffered when telnet_free() is called is discarded.
+ *
+ * \param telnet Telnet state tracker object.
+ * \param size   Size of the buffer in bytes, or 0 to stop buffering.
+ *               Anything in the old buffer is flushed first.
+ * \return TELNET_EOK on success, or TELNET_ENOMEM if allocation failed.
+ */
+extern telnet_error_t telnet_set_send_buffer(telnet_t *telnet,
+		size_t size);
+
+/*!
+ * \brief Send any buffered output.
+ *
+ * Delivers everything collected in the send buffer as one TELNET_EV_SEND
+ * event, and ends any compressed output held back by
+ * telnet_set_compress_flush() with a sync flush so the peer can
+ * decompress all of it.  Does nothing if no output is pending.
+ *
+ * \param telnet Telnet state tracker object.
+ */
+extern void telnet_flush(telnet_t *telnet);
+
+/*!
+ * \brief Choose when compressed output is flushed.
+ *
+ * By default, while MCCP2 compression is active, every write is
+ * compressed with a sync flush of its own, which makes for small
+ * deflate blocks and a poor compression ratio.  With a watermark set,
+ * output is compressed without flushing until that many bytes have
+ * built up, telnet_flush() is called, or a GA or EOR command is sent
+ * with telnet_iac().  libtelnet keeps no clock, so applications that
+ * want a time limit should call telnet_flush() from a timer.
+ *
+ * Does nothing if libtelnet was built without zlib.
+ *
+ * \param telnet    Telnet state tracker object.
+ * \param watermark Uncompressed bytes to hold back before flushing, or
+ *                  0 to flush every write.
+ */
+extern void telnet_set_compress_flush(telnet_t *telnet, size_t watermark);
+
+/*!
+ * \brief Set the parameters used for compressed output.
+ *
+ * Applies to the next compressed stream started with
+ * telnet_begin_compress2().  The defaults are those of zlib's
+ * deflateInit(): level Z_DEFAULT_COMPRESSION, window_bits 15, mem_level
+ * 8 and Z_DEFAULT_STRATEGY, which take about 256 KB per stream.  zlib
+ * needs (1 << (window_bits + 2)) + (1 << (mem_level + 9)) bytes, so for
+ * example window_bits 12 and mem_level 5 need 32 KB at some cost in
+ * compression ratio.  Decompression always uses the full window, since
+ * the peer decides how large a window it compresses with.
+ *
+ * Does nothing if libtelnet was built without zlib.
+ *
+ * \param telnet      Telnet state tracker object.
+ * \param level       Compression level, -1 (default) or 0 to 9.
+ * \param window_bits Base two logarithm of the window size, 9 to 15.
+ * \param mem_level   Memory used for compression state, 1 to 9.
+ * \param strategy    One of zlib's Z_DEFAULT_STRATEGY, Z_FILTERED,
+ *                    Z_HUFFMAN_ONLY, Z_RLE or Z_FIXED.
+ * \return TELNET_EOK on success, or TELNET_EBADVAL if a parameter is
+ *         out of range.
+ */
+extern telnet_error_t telnet_set_compress_params(telnet_t *telnet,
+		int level, int window_bits, int mem_level, int strategy);
+
+/*!
+ * \brief Set the size of the buffer compressed input is inflated into.
+ *
+ * While MCCP2 decompression is active, telnet_recv() inflates received
+ * data into a buffer owned by the state tracker and parses it from
+ * there, so each TELNET_EV_DATA event covers at most this many bytes.
+ * The buffer is 16384 bytes by default.  It is allocated when
+ * compressed data first arrives, freed when compression ends, and
+ * resized at the next telnet_recv() call if this is called while
+ * compression is active.
+ *
+ * Does nothing if libtelnet was built without zlib.
+ *
+ * \param telnet Telnet state tracker object.
+ * \param size   Size of the buffer in bytes.
+ * \return TELNET_EOK on success, or TELNET_EBADVAL if size is 0 or too
+ *         large for zlib.
+ */
+extern telnet_error_t telnet_set_inflate_buffer(telnet_t *telnet,
+		size_t size);
+
+/*!
+ * \brief Allocate compression memory through the application.
+ *
+ * The z_stream and all memory zlib needs for compressing or
+ * decompressing are requested from zalloc and returned to zfree, which
+ * lets applications serve them from a pool shared between connections.
+ * zalloc is called as zlib calls its own: it returns items * size
+ * bytes, or 0 on failure.  The z_stream itself is requested with items
+ * of 1.  Pass 0 for both hooks to go back to the state tracker's
+ * allocator (see telnet_init_ex()).
+ *
+ * The allocator can only be changed while compression is inactive.
+ * Does nothing if libtelnet was built without zlib.
+ *
+ * \param telnet Telnet state tracker object.
+ * \param zalloc Allocation hook, or 0.
+ * \param zfree  Release hook, or 0.
+ * \param opaque Pointer passed to both hooks.
+ * \return TELNET_EOK on success, or TELNET_EBADVAL if only one hook is
+ *         given or compression is active.
+ */
+extern telnet_error_t telnet_set_compress_alloc(telnet_t *telnet,
+		telnet_zalloc_t zalloc, telnet_zfree_t zfree, void *opaque);
+
+/*!
+ * \brief End and restart compression depending on how well it does.
+ *
+ * Once compression has been started with telnet_begin_compress2(), the
+ * state tracker measures each window of output.  If the compressed
+ * output was more than 100 / min_ratio of the original, or output was
+ * flushed on average in pieces smaller than min_flush bytes, as when
+ * echoing keystrokes, the stream is ended as by telnet_end_compress2().
+ * Compression is started again, with the COMPRESS2 marker and a
+ * TELNET_EV_COMPRESS event, when a single write of at least restart
+ * bytes is sent.  With a send buffer each flush is one write.  The
+ * stream is reset rather than freed while compression is off, so
+ * starting it again allocates nothing.
+ *
+ * Not used in proxy mode.  Does nothing if libtelnet was built without
+ * zlib.
+ *
+ * \param telnet    Telnet state tracker object.
+ * \param window    Uncompressed bytes per measurement, or 0 to turn
+ *                  adaptive compression off.
+ * \param min_ratio Smallest compression ratio worth keeping, in percent
+ *                  (150 means 1.5:1), or 0 for no limit.
+ * \param min_flush Smallest average bytes per flush worth keeping, or
+ *                  0 for no limit.
+ * \param restart   Size of a write that restarts compression, or 0 to
+ *                  never restart it.
+ */
+extern void telnet_set_compress_adaptive(telnet_t *telnet, size_t window,
+		unsigned int min_ratio, size_t min_flush, size_t restart);
+
+/*!
+ * \brief Get the statistics counters of a state tracker.
+ *
+ * The counters are kept from telnet_init() on, with plain increments on
+ * the paths that already touch the data, so they cost next to nothing.
+ * A state tracker belongs to one thread, so they are not atomic; call
+ * this from the thread that drives the connection.
+ *
+ * \param telnet Telnet state tracker object.
+ * \param stats  Filled in with a copy of the counters.
+ */
+extern void telnet_get_stats(telnet_t *telnet, telnet_stats_t *stats);
+
 /*!
  * \brief Send a telnet command.
  *
@@ -442,6 +976,27 @@ extern void telnet_negotiate(telnet_t *telnet, unsigned char cmd,
 extern void telnet_send(telnet_t *telnet,
 		const char *buffer, size_t size);
 
+/*!
+ * \brief Send non-command data gathered from several buffers.
+ *
+ * Escapes IAC bytes in all of the buffers in a single pass, as if each
+ * had been passed to telnet_send() in turn, and delivers the result as
+ * TELNET_EV_SENDV events whose iov arrays are ready for writev() or
+ * sendmsg().  The entries point into the caller's buffers rather than
+ * copies, so they are only valid for the duration of the event.  At most
+ * 64 entries are delivered per event; larger output is split across
+ * several events.
+ *
+ * While compression is active or a send buffer is set, the data must be
+ * copied anyway, and is delivered through TELNET_EV_SEND instead.
+ *
+ * \param telnet Telnet state tracker object.
+ * \param iov    Array of buffers to send.
+ * \param count  Number of elements in iov.
+ */
+extern void telnet_sendv(telnet_t *telnet, const telnet_iovec_t *iov,
+		size_t count);
+
 /*!
  * Send non-command text (escapes IAC bytes and translates
  * \\r -> CR-NUL and \\n -> CR-LF unless in BINARY mode.
@@ -506,6 +1061,46 @@ extern void telnet_subnegotiation(telnet_t *telnet, unsigned char telopt,
  */
 extern void telnet_begin_compress2(telnet_t *telnet);
 
+/*!
+ * \brief Begin sending MCCP3 compressed data.
+ *
+ * Sends the COMPRESS3 marker and compresses all further output.  This
+ * is the client side counterpart of telnet_begin_compress2(): the
+ * server must have sent WILL COMPRESS3 and the client agreed with DO
+ * COMPRESS3.  A server receiving the marker decompresses input
+ * automatically.  MCCP2 and MCCP3 may be active at the same time.
+ *
+ * Only the client may call this command.
+ *
+ * \param telnet Telnet state tracker object.
+ */
+extern void telnet_begin_compress3(telnet_t *telnet);
+
+/*!
+ * \brief End MCCP2 compression.
+ *
+ * Finishes the compressed output stream started by
+ * telnet_begin_compress2(), so the peer sees a clean end of stream, and
+ * sends all further output uncompressed.  A TELNET_EV_COMPRESS event
+ * with state 0 is raised.  Buffered output is flushed into the
+ * compressed stream first.  Does nothing if MCCP2 compression is not
+ * active.
+ *
+ * \param telnet Telnet state tracker object.
+ */
+extern void telnet_end_compress2(telnet_t *telnet);
+
+/*!
+ * \brief End MCCP3 compression.
+ *
+ * Same as telnet_end_compress2(), for the stream started by
+ * telnet_begin_compress3().  Does nothing if MCCP3 compression is not
+ * active.
+ *
+ * \param telnet Telnet state tracker object.
+ */
+extern void telnet_end_compress3(telnet_t *telnet);
+
 /*!
  * \brief Send formatted data.
  *
@@ -516,6 +1111,12 @@ extern void telnet_begin_compress2(telnet_t *telnet);
  * \\n with CR LF, as well as automatically escaping IAC bytes like
  * telnet_send().
  *
+ * When a send buffer is set (see telnet_set_send_buffer()) with at
+ * least 1024 bytes free, the output is formatted and escaped directly
+ * in the buffer's free space.  Otherwise output that does not fit on
+ * the stack is formatted in a buffer kept by the state tracker, which
+ * telnet_trim() releases.
+ *
  * \param telnet Telnet state tracker object.
  * \param fmt    Format string.
  * \return Number of bytes sent.
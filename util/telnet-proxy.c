@@ -148,6 +148,7 @@ static const char *get_opt(unsigned char opt) {
 	case 70: return "MSSP";
 	case 85: return "COMPRESS";
 	case 86: return "COMPRESS2";
+	case 87: return "COMPRESS3";
 	case 93: return "ZMP";
 	case 255: return "EXOPL";
 	default: return "unknown";
@@ -213,6 +214,13 @@ static void _event_handler(telnet_t *telnet, telnet_event_t *ev,
 
 		_send(conn->sock, ev->data.buffer, ev->data.size);
 		break;
+	/* buffers must be sent, in order */
+	case TELNET_EV_SENDV: {
+		size_t i;
+		for (i = 0; i != ev->sendv.count; ++i)
+			_send(conn->sock, ev->sendv.iov[i].buffer, ev->sendv.iov[i].size);
+		break;
+	}
 	/* IAC command */
 	case TELNET_EV_IAC:
 		printf("%s IAC %s" COLOR_NORMAL "\n", conn->name,
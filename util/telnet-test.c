@@ -20,8 +20,23 @@
 typedef struct state {
 	char *expected;
 	char *actual;
+	/* non-zero to pause parsing after every event */
+	int pause;
+	/* non-zero to release idle buffers on every subnegotiation */
+	int trim;
+	/* non-zero to print the bytes of output events */
+	int print_send;
+	/* if set, output is received by this state tracker instead, whose
+	 * events are printed after PEER */
+	telnet_t *peer;
 } state_t;
 
+/* allocation counts kept by the allocator given to libtelnet */
+typedef struct alloc_count {
+	size_t allocs; /* allocations since the last mark */
+	size_t live;   /* blocks not yet freed */
+} alloc_count_t;
+
 static const telnet_telopt_t telopts[] = {
  { TELNET_TELOPT_COMPRESS2,	TELNET_WILL, TELNET_DONT },
  { TELNET_TELOPT_ZMP,		TELNET_WILL, TELNET_DONT },
@@ -106,6 +121,7 @@ static const char *get_opt(unsigned char opt) {
 	case 70: return "MSSP";
 	case 85: return "COMPRESS";
 	case 86: return "COMPRESS2";
+	case 87: return "COMPRESS3";
 	case 93: return "ZMP";
 	case 255: return "EXOPL";
 	default: return "unknown";
@@ -142,6 +158,26 @@ static void stprintf(state_t *state, char *format, ...) {
 	va_end(va);
 }
 
+/* counting allocator; there is no realloc hook, so libtelnet's copying
+ * fallback is exercised as well */
+static void *count_malloc(void *ctx, size_t size) {
+	alloc_count_t *count = (alloc_count_t *)ctx;
+	void *ptr;
+
+	if ((ptr = malloc(size)) != NULL) {
+		++count->allocs;
+		++count->live;
+	}
+	return ptr;
+}
+
+static void count_free(void *ctx, void *ptr) {
+	alloc_count_t *count = (alloc_count_t *)ctx;
+
+	--count->live;
+	free(ptr);
+}
+
 static void decode(char *buffer, size_t *size) {
 	const char *in = buffer, *end = buffer + *size;
 	char *out = buffer;
@@ -195,18 +231,33 @@ static void print_encode(state_t *state, const char *buffer, size_t size) {
 		} else if (isprint(*in)) {
 			stprintf(state, "%c", *in);
 		} else {
-			stprintf(state, "%%%02X", *in);
+			stprintf(state, "%%%02X", (unsigned char)*in);
 		}
 		++in;
 	}
 }
 
+/* subnegotiation parser set with #!sb-parser; prints a NUL-terminated
+ * copy made in the scratch space */
+static void sb_print(telnet_t *telnet, unsigned char telopt,
+		const char *buffer, size_t size, void *ctx) {
+	state_t *state = (state_t *)ctx;
+	char *copy;
+
+	if ((copy = (char *)telnet_scratch(telnet, size + 1)) == NULL)
+		return;
+	memcpy(copy, buffer, size);
+	copy[size] = '\0';
+
+	stprintf(state, "PARSED %d (%s) ==> ", (int)telopt, get_opt(telopt));
+	print_encode(state, copy, size);
+	stprintf(state, "\n");
+}
+
 static void event_print(telnet_t *telnet, telnet_event_t *ev, void *ud) {
 	size_t i;
 	state_t *state;
 
-	(void)telnet;
-
 	state = (state_t *)ud;
 
 	switch (ev->type) {
@@ -216,6 +267,27 @@ static void event_print(telnet_t *telnet, telnet_event_t *ev, void *ud) {
 		stprintf(state, "\n");
 		break;
 	case TELNET_EV_SEND:
+		if (state->peer != NULL) {
+			telnet_recv(state->peer, ev->data.buffer, ev->data.size);
+		} else if (state->print_send) {
+			stprintf(state, "SEND [%zu] ==> ", ev->data.size);
+			print_encode(state, ev->data.buffer, ev->data.size);
+			stprintf(state, "\n");
+		}
+		break;
+	case TELNET_EV_SENDV:
+		for (i = 0; i != ev->sendv.count; ++i) {
+			if (state->peer != NULL) {
+				telnet_recv(state->peer, ev->sendv.iov[i].buffer,
+						ev->sendv.iov[i].size);
+			} else if (state->print_send) {
+				stprintf(state, "SENDV %zu/%zu [%zu] ==> ", i + 1,
+						ev->sendv.count, ev->sendv.iov[i].size);
+				print_encode(state, ev->sendv.iov[i].buffer,
+						ev->sendv.iov[i].size);
+				stprintf(state, "\n");
+			}
+		}
 		break;
 	case TELNET_EV_IAC:
 		stprintf(state, "IAC %d (%s)\n", (int)ev->iac.cmd, get_cmd(ev->iac.cmd));
@@ -233,6 +305,8 @@ static void event_print(telnet_t *telnet, telnet_event_t *ev, void *ud) {
 		stprintf(state, "DONT %d (%s)\n", (int)ev->neg.telopt, get_opt(ev->neg.telopt));
 		break;
 	case TELNET_EV_SUBNEGOTIATION:
+		if (state->trim)
+			telnet_trim(telnet);
 		switch (ev->sub.telopt) {
 		case TELNET_TELOPT_ENVIRON:
 		case TELNET_TELOPT_NEW_ENVIRON:
@@ -293,17 +367,59 @@ static void event_print(telnet_t *telnet, telnet_event_t *ev, void *ud) {
 		stprintf(state, "ERROR: %s\n", ev->error.msg);
 		break;
 	}
+
+	if (state->pause && ev->type != TELNET_EV_SEND &&
+			ev->type != TELNET_EV_SENDV)
+		telnet_pause(telnet);
+}
+
+/* event handler of the peer set up by #!peer; its own output goes
+ * nowhere */
+static void peer_print(telnet_t *telnet, telnet_event_t *ev, void *ud) {
+	if (ev->type == TELNET_EV_SEND || ev->type == TELNET_EV_SENDV)
+		return;
+
+	stprintf((state_t *)ud, "PEER ");
+	event_print(telnet, ev, ud);
+}
+
+/* send the space separated buffers following #!sendv with
+ * telnet_sendv() */
+static void sendv(telnet_t *telnet, char *buffer) {
+	telnet_iovec_t iov[16];
+	size_t count = 0, len;
+	char *part;
+
+	for (part = strtok(buffer, " \n"); part != NULL && count != 16;
+			part = strtok(NULL, " \n")) {
+		len = strlen(part);
+		decode(part, &len);
+		iov[count].buffer = part;
+		iov[count].size = len;
+		++count;
+	}
+	telnet_sendv(telnet, iov, count);
 }
 
 int main(int argc, char** argv) {
 	FILE *fh;
 	telnet_t *telnet;
 	char buffer[4096];
-	size_t len;
+	size_t len, pos, n;
+	unsigned long window, ratio, flush, restart;
+	unsigned long initial, growth, max, shrink;
 	state_t state;
+	alloc_count_t count;
+	telnet_allocator_t allocator;
+	telnet_event_t ev;
+	int pull = 0;
 
 	state.expected = NULL;
 	state.actual = NULL;
+	state.pause = 0;
+	state.trim = 0;
+	state.print_send = 0;
+	state.peer = NULL;
 
 	/* check for a requested input file */
 	if (argc != 3) {
@@ -332,20 +448,109 @@ int main(int argc, char** argv) {
 	}
 
 	/* create telnet parser instance */
-	if ((telnet = telnet_init(telopts, event_print, 0,
-			&state)) == 0) {
+	count.allocs = 0;
+	count.live = 0;
+	allocator.malloc_hook = count_malloc;
+	allocator.realloc_hook = NULL;
+	allocator.free_hook = count_free;
+	allocator.ctx = &count;
+	if ((telnet = telnet_init_ex(telopts, event_print, 0,
+			&state, &allocator)) == 0) {
 		fprintf(stderr, "Failed to initialize libtelnet: %s\n",
 				strerror(errno));
 		fclose(fh);
 		return 4;
 	}
 
-	/* read input until we hit EOF or marker */
+	/* read input until we hit EOF or marker; #!mark-allocs and
+	 * #!check-allocs lines report the allocations in between, after
+	 * #!pull events are pulled with telnet_next_event(), and after
+	 * #!pause parsing pauses at every event and resumes where it
+	 * stopped.  after #!trim every subnegotiation event calls
+	 * telnet_trim().  #!print-send prints output events, and after
+	 * #!peer output is received by a second state tracker whose events
+	 * are printed instead.  #!send, #!sendv and #!printf send the
+	 * encoded text following, and #!send-buffer, #!flush,
+	 * #!compress-flush, #!compress-adaptive, #!compress2,
+	 * #!end-compress2, #!compress3, #!end-compress3 and #!sb-limits
+	 * call the functions of those names.  #!mask sets the event mask to the hex number following,
+	 * and #!sb-parser and #!sb-builtin set the parser of the telopt
+	 * following to sb_print() and back to the built in one */
 	while (fgets(buffer, sizeof(buffer), fh) != NULL && strcmp(buffer, "%%\n") != 0) {
-		if (buffer[0] != '#') {
+		if (strcmp(buffer, "#!mark-allocs\n") == 0) {
+			count.allocs = 0;
+		} else if (strcmp(buffer, "#!check-allocs\n") == 0) {
+			stprintf(&state, "ALLOCATIONS %zu\n", count.allocs);
+		} else if (strcmp(buffer, "#!pull\n") == 0) {
+			pull = 1;
+		} else if (strcmp(buffer, "#!pause\n") == 0) {
+			state.pause = 1;
+		} else if (strcmp(buffer, "#!trim\n") == 0) {
+			state.trim = 1;
+		} else if (strcmp(buffer, "#!print-send\n") == 0) {
+			state.print_send = 1;
+		} else if (strcmp(buffer, "#!peer\n") == 0) {
+			if (state.peer == NULL)
+				state.peer = telnet_init(telopts, peer_print, 0, &state);
+		} else if (strncmp(buffer, "#!send ", 7) == 0) {
+			len = strlen(buffer + 7);
+			decode(buffer + 7, &len);
+			telnet_send(telnet, buffer + 7, len);
+		} else if (strncmp(buffer, "#!sendv ", 8) == 0) {
+			sendv(telnet, buffer + 8);
+		} else if (strncmp(buffer, "#!printf ", 9) == 0) {
+			len = strlen(buffer + 9);
+			decode(buffer + 9, &len);
+			telnet_printf(telnet, "%s", buffer + 9);
+		} else if (strncmp(buffer, "#!send-buffer ", 14) == 0) {
+			telnet_set_send_buffer(telnet,
+					(size_t)strtoul(buffer + 14, NULL, 10));
+		} else if (strcmp(buffer, "#!flush\n") == 0) {
+			telnet_flush(telnet);
+		} else if (strncmp(buffer, "#!compress-flush ", 17) == 0) {
+			telnet_set_compress_flush(telnet,
+					(size_t)strtoul(buffer + 17, NULL, 10));
+		} else if (sscanf(buffer, "#!compress-adaptive %lu %lu %lu %lu",
+				&window, &ratio, &flush, &restart) == 4) {
+			telnet_set_compress_adaptive(telnet, (size_t)window,
+					(unsigned int)ratio, (size_t)flush, (size_t)restart);
+		} else if (sscanf(buffer, "#!sb-limits %lu %lu %lu %lu",
+				&initial, &growth, &max, &shrink) == 4) {
+			telnet_set_sb_limits(telnet, (size_t)initial,
+					(unsigned int)growth, (size_t)max, (unsigned int)shrink);
+		} else if (strcmp(buffer, "#!compress2\n") == 0) {
+			telnet_begin_compress2(telnet);
+		} else if (strcmp(buffer, "#!end-compress2\n") == 0) {
+			telnet_end_compress2(telnet);
+		} else if (strcmp(buffer, "#!compress3\n") == 0) {
+			telnet_begin_compress3(telnet);
+		} else if (strcmp(buffer, "#!end-compress3\n") == 0) {
+			telnet_end_compress3(telnet);
+		} else if (strncmp(buffer, "#!mask ", 7) == 0) {
+			telnet_set_event_mask(telnet,
+					(unsigned int)strtoul(buffer + 7, NULL, 16));
+		} else if (strncmp(buffer, "#!sb-parser ", 12) == 0) {
+			telnet_set_sb_parser(telnet,
+					(unsigned char)strtoul(buffer + 12, NULL, 10),
+					sb_print, &state);
+		} else if (strncmp(buffer, "#!sb-builtin ", 13) == 0) {
+			telnet_set_sb_parser(telnet,
+					(unsigned char)strtoul(buffer + 13, NULL, 10), NULL,
+					NULL);
+		} else if (buffer[0] != '#') {
 			len = strlen(buffer);
 			decode(buffer, &len);
-			telnet_recv(telnet, buffer, len);
+			if (pull) {
+				telnet_feed(telnet, buffer, len);
+				while (telnet_next_event(telnet, &ev))
+					event_print(telnet, &ev, &state);
+			} else if (state.pause) {
+				for (pos = 0; pos != len; pos += n) {
+					n = telnet_recv_partial(telnet, buffer + pos, len - pos);
+					stprintf(&state, "CONSUMED %zu\n", n);
+				}
+			} else
+				telnet_recv(telnet, buffer, len);
 		}
 	}
 
@@ -359,8 +564,16 @@ int main(int argc, char** argv) {
 
 	/* clean up */
 	telnet_free(telnet);
+	if (state.peer != NULL)
+		telnet_free(state.peer);
 	free(state.expected);
 	free(state.actual);
 
+	/* everything libtelnet allocated must have gone back */
+	if (count.live != 0) {
+		fprintf(stderr, "%zu blocks not freed\n", count.live);
+		return 6;
+	}
+
 	return 0;
 }